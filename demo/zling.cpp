@@ -36,6 +36,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <memory>
 
 #define __STDC_FORMAT_MACROS
 
@@ -58,17 +59,6 @@
 
 #include "libzling/libzling.h"
 
-static inline uint32_t ComputeAdler32(unsigned char* data, size_t size) {
-    uint32_t a = 1;
-    uint32_t b = 0;
-
-    for (size_t i = 0; i < size; i++) {
-        a = (a + data[i]) % 65521;
-        b = (b + a) % 65521;
-    }
-    return (b << 16) | a;
-}
-
 #define ENABLE_ADLER32_CHECKSUM 0
 
 struct DemoActionHandler: baidu::zling::ActionHandler {
@@ -76,8 +66,8 @@ struct DemoActionHandler: baidu::zling::ActionHandler {
         m_clockstart = clock();
     }
     void OnInit() {
-        m_inputter  = dynamic_cast<baidu::zling::FileInputter*>(GetInputter());
-        m_outputter = dynamic_cast<baidu::zling::FileOutputter*>(GetOutputter());
+        m_inputter  = GetInputter();
+        m_outputter = GetOutputter();
     }
 
     void OnDone() {
@@ -123,9 +113,9 @@ struct DemoActionHandler: baidu::zling::ActionHandler {
         // adler32 checksum
 #if ENABLE_ADLER32_CHECKSUM
         if (IsEncode()) {
-            m_outputter->PutUInt32(ComputeAdler32(orig_data, orig_size));
+            m_outputter->PutUInt32(baidu::zling::ComputeAdler32(orig_data, orig_size));
         } else {
-            if (m_inputter->GetUInt32() != ComputeAdler32(orig_data, orig_size)) {
+            if (m_inputter->GetUInt32() != baidu::zling::ComputeAdler32(orig_data, orig_size)) {
                 throw std::runtime_error("baidu::zling::Decode(): adler32 checksum not match.");
             }
         }
@@ -151,8 +141,8 @@ struct DemoActionHandler: baidu::zling::ActionHandler {
     }
 
 private:
-    baidu::zling::FileInputter*  m_inputter;
-    baidu::zling::FileOutputter* m_outputter;
+    baidu::zling::Inputter*  m_inputter;
+    baidu::zling::Outputter* m_outputter;
     clock_t m_clockstart;
 };
 
@@ -160,6 +150,10 @@ int main(int argc, char** argv) {
     baidu::zling::FileInputter  inputter(stdin);
     baidu::zling::FileOutputter outputter(stdout);
     DemoActionHandler demo_handler;
+    baidu::zling::ZlingConfig config;
+    int thread_num = 1;
+    bool pipelined = false;
+    std::vector<unsigned char> dict_data;
 
 #if defined(__MINGW32__) || defined(__MINGW64__)
     setmode(fileno(stdin),  O_BINARY);  // set stdio to binary mode for windows
@@ -172,6 +166,46 @@ int main(int argc, char** argv) {
     fprintf(stderr, "   by Zhang Li <zhangli10 at baidu.com>\n");
     fprintf(stderr, "\n");
 
+    // zling -t <threads> -p -b <block size> -D <dictionary> ...
+    while (argc >= 3 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-t") == 0) {
+            thread_num = atoi(argv[2]);
+            argv += 2;
+            argc -= 2;
+            continue;
+        }
+        if (strcmp(argv[1], "-b") == 0) {
+            config.block_size = atoi(argv[2]) * 1024;
+            argv += 2;
+            argc -= 2;
+            continue;
+        }
+        if (strcmp(argv[1], "-D") == 0) {
+            FILE* fp = fopen(argv[2], "rb");
+            unsigned char buf[4096];
+            size_t len;
+
+            if (fp == NULL) {
+                fprintf(stderr, "error: cannot open file '%s' for read.\n", argv[2]);
+                return -1;
+            }
+            while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
+                dict_data.insert(dict_data.end(), buf, buf + len);
+            }
+            fclose(fp);
+            argv += 2;
+            argc -= 2;
+            continue;
+        }
+        if (strcmp(argv[1], "-p") == 0) {
+            pipelined = true;
+            argv += 1;
+            argc -= 1;
+            continue;
+        }
+        break;
+    }
+
     // zling <e/d> __argv2__ __argv3__
     if (argc == 4) {
         if (freopen(argv[3], "wb", stdout) == NULL) {
@@ -192,27 +226,41 @@ int main(int argc, char** argv) {
 
     // zling <e/d> (stdin) (stdout)
     try {
+        std::unique_ptr<baidu::zling::ZlingDictionary> dictionary(
+            dict_data.empty() ? NULL : new baidu::zling::ZlingDictionary(dict_data.data(), dict_data.size()));
+
+        if (argc == 2 && strcmp(argv[1], "e5") == 0) {
+            return baidu::zling::Encode(&inputter, &outputter, &demo_handler, 5, thread_num, pipelined, config, dictionary.get());
+        }
         if (argc == 2 && strcmp(argv[1], "e4") == 0) {
-            return baidu::zling::Encode(&inputter, &outputter, &demo_handler, 4);
+            return baidu::zling::Encode(&inputter, &outputter, &demo_handler, 4, thread_num, pipelined, config, dictionary.get());
         }
         if (argc == 2 && strcmp(argv[1], "e3") == 0) {
-            return baidu::zling::Encode(&inputter, &outputter, &demo_handler, 3);
+            return baidu::zling::Encode(&inputter, &outputter, &demo_handler, 3, thread_num, pipelined, config, dictionary.get());
         }
         if (argc == 2 && strcmp(argv[1], "e2") == 0) {
-            return baidu::zling::Encode(&inputter, &outputter, &demo_handler, 2);
+            return baidu::zling::Encode(&inputter, &outputter, &demo_handler, 2, thread_num, pipelined, config, dictionary.get());
         }
         if (argc == 2 && strcmp(argv[1], "e1") == 0) {
-            return baidu::zling::Encode(&inputter, &outputter, &demo_handler, 1);
+            return baidu::zling::Encode(&inputter, &outputter, &demo_handler, 1, thread_num, pipelined, config, dictionary.get());
         }
         if (argc == 2 && strcmp(argv[1], "e0") == 0) {
-            return baidu::zling::Encode(&inputter, &outputter, &demo_handler, 0);
+            return baidu::zling::Encode(&inputter, &outputter, &demo_handler, 0, thread_num, pipelined, config, dictionary.get());
+        }
+        if (argc == 2 && strcmp(argv[1], "e-1") == 0) {
+            return baidu::zling::Encode(&inputter, &outputter, &demo_handler, -1, thread_num, pipelined, config, dictionary.get());
+        }
+        if (argc == 2 && strncmp(argv[1], "ea", 2) == 0) {
+            int weight = (argv[1][2] != '\0') ? atoi(argv[1] + 2) : 50;
+            return baidu::zling::Encode(&inputter, &outputter, &demo_handler, baidu::zling::kLevelAuto + weight,
+                                        thread_num, pipelined, config, dictionary.get());
         }
 
         if (argc == 2 && strcmp(argv[1], "e") == 0) {
-            return baidu::zling::Encode(&inputter, &outputter, &demo_handler, 0);
+            return baidu::zling::Encode(&inputter, &outputter, &demo_handler, 0, thread_num, pipelined, config, dictionary.get());
         }
         if (argc == 2 && strcmp(argv[1], "d") == 0) {
-            return baidu::zling::Decode(&inputter, &outputter, &demo_handler);
+            return baidu::zling::Decode(&inputter, &outputter, &demo_handler, thread_num, pipelined, dictionary.get());
         }
 
     } catch (const std::runtime_error& e) {
@@ -226,10 +274,16 @@ int main(int argc, char** argv) {
 
     // help message
     fprintf(stderr, "usage:\n");
-    fprintf(stderr, "   zling e[N=0,1,2,3,4] source target\n");
-    fprintf(stderr, "   zling d source target\n");
+    fprintf(stderr, "   zling [-t T] [-p] [-b B] [-D D] e[N=-1,0,1,2,3,4,5] source target\n");
+    fprintf(stderr, "   zling [-t T] [-p] [-b B] [-D D] ea[W=0..100] source target\n");
+    fprintf(stderr, "   zling [-t T] [-p] [-D D] d source target\n");
     fprintf(stderr, "    * source: (default: stdin)\n");
     fprintf(stderr, "    * target: (default: stdout)\n");
     fprintf(stderr, "    * N:      (default: 0) compression level, bigger level for better and slower compression.\n");
+    fprintf(stderr, "    * W:      (default: 50) automatic level for each block, weight of ratio against speed.\n");
+    fprintf(stderr, "    * T:      (default: 1) number of worker threads.\n");
+    fprintf(stderr, "    * -p:     overlap I/O with compression in a separate I/O thread.\n");
+    fprintf(stderr, "    * B:      (default: 16384) block size in KB, power of 2 in [64, 262144].\n");
+    fprintf(stderr, "    * D:      preset dictionary file, streams encoded with it also need it for decoding.\n");
     return -1;
 }
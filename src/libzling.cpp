@@ -33,9 +33,11 @@
  * @brief  libzling.
  */
 #include "libzling.h"
+#include "libzling_cpu.h"
 #include "libzling_debug.h"
 #include "libzling_huffman.h"
 #include "libzling_lz.h"
+#include "libzling_thread.h"
 
 namespace baidu {
 namespace zling {
@@ -45,10 +47,14 @@ using huffman::ZlingMakeEncodeTable;
 using huffman::ZlingMakeDecodeTable;
 using lz::ZlingRolzEncoder;
 using lz::ZlingRolzDecoder;
+using lz::ZlingRolzPrices;
+using lz::ZlingRolzDictionary;
 
 using lz::kMatchMaxLen;
 using lz::kMatchMinLen;
 using lz::kBucketItemSize;
+using lz::kBucketItemHash;
+using lz::Log2;
 
 static const uint32_t matchidx_bitlen[] = {
 #   include "tables/table_matchidx_blen.inc"  /* include auto-generated constant tables */
@@ -65,26 +71,58 @@ static const int kHuffmanCodes2      = sizeof(matchidx_base) / sizeof(matchidx_b
 static const int kHuffmanMaxLen1     = 15;
 static const int kHuffmanMaxLen2     = 8;
 static const int kHuffmanMaxLen1Fast = 10;
+static const int kHuffmanMatchIdxLen = 12;  /* bits looked up at once for a match index (code + ex-bits) */
+static const int kHuffmanStreams     = 4;
+static const int kHuffmanMultiStreamMinLen = 16384;
+static const int kHuffmanHeaderLen   = (kHuffmanCodes1 + 1) / 2 + (kHuffmanCodes2 + 1) / 2;
 static const int kSentinelLen        = kMatchMaxLen + 16;
 
-static const int kBlockSizeIn      = 16777216;
-static const int kBlockSizeRolz    = 262144;
-static const int kBlockSizeHuffman = 393216;
+static const int kBlockSizeIn      = 16777216;  /* default */
+static const int kBlockSizeRolz    = 262144;    /* default */
 
-/* codebuf: manipulate code (u64) buffer.
- *  Input();
+/* HUFFMAN output never exceeds 1.5 bytes per ROLZ symbol (codes of sub-blocks are at most 10 bits
+ * per symbol on average, 8 + 11 extra bits for each match index symbol)
+ */
+static inline int GetBlockSizeHuffman(int rolz_size) {
+    return rolz_size / 2 * 3;
+}
+
+static const int kPipelineSubBlocks = 4;
+static const int kPipelineChunkSize = 1048576;  /* max */
+
+/* pipelined I/O rings hold two blocks (double buffered), in chunks of at most kPipelineChunkSize */
+static inline int GetPipelineChunkSize(int block_size) {
+    return std::min(kPipelineChunkSize, block_size / 2);
+}
+static inline int GetPipelineChunks(int block_size) {
+    return block_size / GetPipelineChunkSize(block_size) * 2;
+}
+
+/* bitreader: read codes LSB-first from a byte buffer with 64-bit little-endian loads.
+ *  Refill(); -- tops the buffer up to at least 56 bits without branching. the read position never
+ *               moves past end, so the buffer needs 8 bytes of padding after end.
  *  Output();
  *  Peek();
- *  GetLength();
  */
-struct ZlingCodebuf {
-    ZlingCodebuf():
+struct ZlingBitReader {
+    ZlingBitReader():
+        m_pos(NULL),
+        m_end(NULL),
         m_buf(0),
         m_len(0) {}
 
-    inline void Input(uint64_t code, int len) {
-        m_buf |= code << m_len;
-        m_len += len;
+    inline void Init(const unsigned char* pos, const unsigned char* end) {
+        m_pos = pos;
+        m_end = end;
+        m_buf = 0;
+        m_len = 0;
+        return;
+    }
+    inline void Refill() {
+        m_buf |= cpu::LoadUInt64(m_pos) << m_len;
+        m_pos += (63 - m_len) >> 3;
+        m_pos = std::min(m_pos, m_end);
+        m_len |= 56;
         return;
     }
     inline uint64_t Output(int len) {
@@ -94,71 +132,300 @@ struct ZlingCodebuf {
         return out;
     }
     inline uint64_t Peek(int len) const {
-        return m_buf & ~(-1ull << len);
+        return m_buf & ((1ull << len) - 1);
+    }
+private:
+    const unsigned char* m_pos;
+    const unsigned char* m_end;
+    uint64_t m_buf;
+    int m_len;
+};
+
+/* bitwriter: write codes LSB-first into a byte buffer with 64-bit little-endian stores.
+ *  Input();  -- at most 56 bits between two Flush()
+ *  Flush();  -- stores 8 bytes, buffer needs 8 bytes of slack after the data
+ *  Finish(); -- writes the last partial byte, returns bytes written
+ */
+struct ZlingBitWriter {
+    explicit ZlingBitWriter(unsigned char* buf):
+        m_start(buf),
+        m_pos(buf),
+        m_buf(0),
+        m_len(0) {}
+
+    inline void Input(uint64_t code, int len) {
+        m_buf |= code << m_len;
+        m_len += len;
+        return;
+    }
+    inline void Flush() {
+        cpu::StoreUInt64(m_pos, m_buf);
+        m_pos += m_len >> 3;
+        m_buf >>= m_len & ~7;
+        m_len &= 7;
+        return;
     }
-    inline int GetLength() const {
-        return m_len;
+    inline int Finish() {
+        Flush();
+        m_pos += (m_len + 7) / 8;
+        m_buf = 0;
+        m_len = 0;
+        return m_pos - m_start;
     }
 private:
+    unsigned char* m_start;
+    unsigned char* m_pos;
     uint64_t m_buf;
     int m_len;
 };
 
-/* encode/decode allocation resource: auto free */
+/* encode sub-block: a ROLZ sub-block passed from the ROLZ stage to the HUFFMAN stage */
+struct EncodeSubBlock {
+    unsigned char* obuf;
+    uint16_t* tbuf;
+    int encflag;
+    int encpos;
+    int rlen;
+    int olen;
+    uint32_t length_table1[kHuffmanCodes1 + (kHuffmanCodes1 % 2)];
+    uint32_t length_table2[kHuffmanCodes2 + (kHuffmanCodes2 % 2)];
+    std::future<void> done;
+};
+
+/* decode tables of a sub-block, also used by following sub-blocks with kFlagRolzReuseTables
+ *  decode_table1_fast: one or two symbols for the next kHuffmanMaxLen1Fast bits, packed as
+ *      bits 0..9:   first symbol
+ *      bits 10..18: second symbol (literal/word only)
+ *      bits 19..22: code length of first symbol
+ *      bits 23..26: code length of both symbols
+ *      bit  27:     has second symbol
+ *    or -1 for codes longer than kHuffmanMaxLen1Fast (look up decode_table1 instead).
+ *  decode_table2: match index for the next kHuffmanMatchIdxLen bits, packed as
+ *      bits 0..15:  match index, or its base if ex-bits do not fit
+ *      bits 16..23: bits consumed
+ *      bits 24..31: ex-bits still to read
+ *    or -1 for invalid codes.
+ */
+struct DecodeTables {
+    uint32_t length_table1[kHuffmanCodes1 + (kHuffmanCodes1 % 2)];
+    uint32_t length_table2[kHuffmanCodes2 + (kHuffmanCodes2 % 2)];
+    uint16_t decode_table1[1 << kHuffmanMaxLen1];
+    uint32_t decode_table1_fast[1 << kHuffmanMaxLen1Fast];
+    uint32_t decode_table2[1 << kHuffmanMatchIdxLen];
+};
+
+/* decode sub-block: a ROLZ sub-block passed from the HUFFMAN stage to the ROLZ stage */
+struct DecodeSubBlock {
+    unsigned char* obuf;
+    uint16_t* tbuf;
+    const DecodeTables* tables;
+    int encflag;
+    int encpos;
+    int rlen;
+    int olen;
+    std::future<void> done;
+};
+
+static const size_t kDictionaryMaxSize = 1 << 27;  /* half of the largest block_size */
+
+/* preset dictionary (see libzling.h), state shared by all blocks of streams using it:
+ *  rolz:            ROLZ state
+ *  length_table1/2: HUFFMAN tables of the ROLZ coded dictionary (with all symbols), the first
+ *                   sub-block of a block can reuse them like tables of a previous sub-block.
+ *  tables:          decode tables of them
+ */
+struct ZlingDictionary::Impl {
+    Impl(const unsigned char* data, size_t size);
+
+    ZlingRolzDictionary rolz;
+    uint32_t id;
+    uint32_t length_table1[kHuffmanCodes1 + (kHuffmanCodes1 % 2)];
+    uint32_t length_table2[kHuffmanCodes2 + (kHuffmanCodes2 % 2)];
+    DecodeTables tables;
+};
+
+/* encode/decode allocation resource: auto free.
+ *  in arena mode, the arena is sized by GetMemorySize() (which also counts some small objects allocated
+ *  by new) plus kArenaPadding for alignment of each buffer.
+ */
+static const size_t kArenaPadding = 64 * 64;
+
 struct EncodeResource {
     ZlingRolzEncoder* lzencoder;
     unsigned char* ibuf;
-    unsigned char* obuf;
-    uint16_t* tbuf;
+    EncodeSubBlock* subblocks;
+    const ZlingDictionary::Impl* dictionary;  /* NULL if not used, its data is kept in front of block data */
+    int subblock_num;
+    ZlingConfig config;
+    Allocator* allocator;  /* arena.get() in arena mode */
+    std::unique_ptr<ArenaAllocator> arena;
 
-    EncodeResource(): lzencoder(NULL), ibuf(NULL), obuf(NULL), tbuf(NULL) {
+    /* EncodeResource:
+     *  arg allocator:  allocator of block/sub-block buffers and ROLZ buckets
+     *  arg use_arena:  allocate all of them from one contiguous allocation
+     */
+    EncodeResource(const ZlingConfig& config, int subblock_num = 1, Allocator* allocator = GetDefaultAllocator(),
+                   bool use_arena = false):
+        lzencoder(NULL),
+        ibuf(NULL),
+        subblocks(NULL),
+        dictionary(NULL),
+        subblock_num(subblock_num),
+        config(config),
+        allocator(allocator) {
         try {
-            ibuf = new unsigned char[kBlockSizeIn + kSentinelLen];
-            obuf = new unsigned char[kBlockSizeHuffman + kSentinelLen];
-            tbuf = new uint16_t[kBlockSizeRolz + kSentinelLen];
-            lzencoder = new ZlingRolzEncoder();
+            if (use_arena) {
+                arena.reset(new ArenaAllocator(GetMemorySize(config, subblock_num) + kArenaPadding, allocator));
+                this->allocator = allocator = arena.get();
+            }
+            ibuf = static_cast<unsigned char*>(allocator->Allocate(config.block_size + kSentinelLen));
+            subblocks = new EncodeSubBlock[subblock_num]();
+            for (int i = 0; i < subblock_num; i++) {
+                subblocks[i].obuf = static_cast<unsigned char*>(
+                    allocator->Allocate(GetBlockSizeHuffman(config.rolz_size) + kSentinelLen));
+                subblocks[i].tbuf = static_cast<uint16_t*>(
+                    allocator->Allocate((config.rolz_size + kSentinelLen) * sizeof(uint16_t)));
+            }
+            lzencoder = new ZlingRolzEncoder(config.bucket_size, config.bucket_hash, Log2(config.block_size), allocator);
 
         } catch (const std::bad_alloc& e) {
-            delete lzencoder;
-            delete [] ibuf;
-            delete [] obuf;
-            delete [] tbuf;
+            Free();
             throw std::bad_alloc();
         }
     }
     ~EncodeResource() {
+        Free();
+    }
+
+    static size_t GetMemorySize(const ZlingConfig& config, int subblock_num) {
+        return sizeof(EncodeResource)
+            + (config.block_size + kSentinelLen)
+            + subblock_num * (sizeof(EncodeSubBlock)
+                              + (GetBlockSizeHuffman(config.rolz_size) + kSentinelLen)
+                              + (config.rolz_size + kSentinelLen) * sizeof(uint16_t))
+            + ZlingRolzEncoder::GetMemorySize(config.bucket_size, config.bucket_hash);
+    }
+    size_t GetMemorySize() const {
+        return GetMemorySize(config, subblock_num) + (arena ? kArenaPadding : 0);
+    }
+
+    /* SetDictionary: encode following blocks with dictionary (NULL: without dictionary), block data
+     *  is read into ibuf[GetDictionaryLen()..block_size).
+     */
+    void SetDictionary(const ZlingDictionary* dictionary) {
+        this->dictionary = (dictionary != NULL) ? dictionary->m_impl : NULL;
+        if (this->dictionary != NULL) {
+            memcpy(ibuf, this->dictionary->rolz.data.data(), this->dictionary->rolz.data.size());
+        }
+    }
+    int GetDictionaryLen() const {
+        return (dictionary != NULL) ? dictionary->rolz.data.size() : 0;
+    }
+
+private:
+    void Free() {
+        for (int i = 0; subblocks != NULL && i < subblock_num; i++) {
+            if (subblocks[i].obuf != NULL) {
+                allocator->Free(subblocks[i].obuf, GetBlockSizeHuffman(config.rolz_size) + kSentinelLen);
+            }
+            if (subblocks[i].tbuf != NULL) {
+                allocator->Free(subblocks[i].tbuf, (config.rolz_size + kSentinelLen) * sizeof(uint16_t));
+            }
+        }
+        if (ibuf != NULL) {
+            allocator->Free(ibuf, config.block_size + kSentinelLen);
+        }
         delete lzencoder;
-        delete [] ibuf;
-        delete [] obuf;
-        delete [] tbuf;
+        delete [] subblocks;
     }
 };
 struct DecodeResource {
     ZlingRolzDecoder* lzdecoder;
     unsigned char* ibuf;
-    unsigned char* obuf;
-    uint16_t* tbuf;
+    DecodeSubBlock* subblocks;
+    DecodeTables* tables;  /* subblock_num tables, enough for all sub-blocks in the pipeline */
+    const ZlingDictionary::Impl* dictionary;  /* NULL if not used, its data is decoded in front of block data */
+    int subblock_num;
+    ZlingConfig config;
+    Allocator* allocator;  /* arena.get() in arena mode */
+    std::unique_ptr<ArenaAllocator> arena;
 
-    DecodeResource(): lzdecoder(NULL), ibuf(NULL), obuf(NULL), tbuf(NULL) {
+    DecodeResource(const ZlingConfig& config, int subblock_num = 1, Allocator* allocator = GetDefaultAllocator(),
+                   bool use_arena = false):
+        lzdecoder(NULL),
+        ibuf(NULL),
+        subblocks(NULL),
+        tables(NULL),
+        dictionary(NULL),
+        subblock_num(subblock_num),
+        config(config),
+        allocator(allocator) {
         try {
-            ibuf = new unsigned char[kBlockSizeIn + kSentinelLen];
-            obuf = new unsigned char[kBlockSizeHuffman + kSentinelLen];
-            tbuf = new uint16_t[kBlockSizeRolz + kSentinelLen];
-            lzdecoder = new ZlingRolzDecoder();
+            if (use_arena) {
+                arena.reset(new ArenaAllocator(GetMemorySize(config, subblock_num) + kArenaPadding, allocator));
+                this->allocator = allocator = arena.get();
+            }
+            ibuf = static_cast<unsigned char*>(allocator->Allocate(config.block_size + kSentinelLen));
+            subblocks = new DecodeSubBlock[subblock_num]();
+            for (int i = 0; i < subblock_num; i++) {
+                subblocks[i].obuf = static_cast<unsigned char*>(
+                    allocator->Allocate(GetBlockSizeHuffman(config.rolz_size) + kSentinelLen));
+                subblocks[i].tbuf = static_cast<uint16_t*>(
+                    allocator->Allocate((config.rolz_size + kSentinelLen) * sizeof(uint16_t)));
+            }
+            tables = static_cast<DecodeTables*>(allocator->Allocate(subblock_num * sizeof(DecodeTables)));
+            lzdecoder = new ZlingRolzDecoder(config.bucket_size, allocator);
 
         } catch (const std::bad_alloc& e) {
-            delete lzdecoder;
-            delete [] ibuf;
-            delete [] obuf;
-            delete [] tbuf;
+            Free();
             throw std::bad_alloc();
         }
     }
     ~DecodeResource() {
+        Free();
+    }
+
+    static size_t GetMemorySize(const ZlingConfig& config, int subblock_num) {
+        return sizeof(DecodeResource)
+            + (config.block_size + kSentinelLen)
+            + subblock_num * (sizeof(DecodeSubBlock)
+                              + sizeof(DecodeTables)
+                              + (GetBlockSizeHuffman(config.rolz_size) + kSentinelLen)
+                              + (config.rolz_size + kSentinelLen) * sizeof(uint16_t))
+            + ZlingRolzDecoder::GetMemorySize(config.bucket_size);
+    }
+    size_t GetMemorySize() const {
+        return GetMemorySize(config, subblock_num) + (arena ? kArenaPadding : 0);
+    }
+
+    /* SetDictionary: decode following blocks with dictionary (NULL: without dictionary), block data
+     *  is decoded into ibuf[GetDictionaryLen()..decpos).
+     */
+    void SetDictionary(const ZlingDictionary* dictionary) {
+        this->dictionary = (dictionary != NULL) ? dictionary->m_impl : NULL;
+    }
+    int GetDictionaryLen() const {
+        return (dictionary != NULL) ? dictionary->rolz.data.size() : 0;
+    }
+
+private:
+    void Free() {
+        for (int i = 0; subblocks != NULL && i < subblock_num; i++) {
+            if (subblocks[i].obuf != NULL) {
+                allocator->Free(subblocks[i].obuf, GetBlockSizeHuffman(config.rolz_size) + kSentinelLen);
+            }
+            if (subblocks[i].tbuf != NULL) {
+                allocator->Free(subblocks[i].tbuf, (config.rolz_size + kSentinelLen) * sizeof(uint16_t));
+            }
+        }
+        if (tables != NULL) {
+            allocator->Free(tables, subblock_num * sizeof(DecodeTables));
+        }
+        if (ibuf != NULL) {
+            allocator->Free(ibuf, config.block_size + kSentinelLen);
+        }
         delete lzdecoder;
-        delete [] ibuf;
-        delete [] obuf;
-        delete [] tbuf;
+        delete [] subblocks;
     }
 };
 
@@ -168,262 +435,1549 @@ struct DecodeResource {
     } \
 } while(0)
 
-static const int kFlagRolzContinue = 1;
-static const int kFlagRolzStop     = 0;
+static const int kFlagRolzContinue    = 1;
+static const int kFlagRolzMultiStream = 2;
+static const int kFlagRolzStored      = 3;
+static const int kFlagRolzStop        = 0;
+static const int kFlagRolzReuseTables = 4;  /* with kFlagRolzContinue/kFlagRolzMultiStream */
 
-int Encode(Inputter* inputter, Outputter* outputter, ActionHandler* action_handler, int level) {
-    if (action_handler) {
-        action_handler->SetInputterOutputter(inputter, outputter, true);
-        action_handler->OnInit();
+/* stream header: legacy streams (without header) start with kFlagRolzContinue.
+ *  version 1: blocks are independent (MTF tables are reset for each block).
+ *  version 2: kFlagRolzMultiStream sub-blocks.
+ *  version 3: followed by log2 of block_size, rolz_size, bucket_size and bucket_hash (one byte each).
+ *             earlier versions use the default ZlingConfig.
+ *  version 4: kFlagRolzStored sub-blocks.
+ *  version 5: kFlagRolzReuseTables sub-blocks.
+ *  version 6: followed by the id of the preset dictionary (4 bytes), blocks start with its state.
+ *             streams without dictionary are still written as version 5.
+ */
+static const int kFlagStreamHeader = 0x7a;
+static const int kStreamVersion    = 6;
+static const int kStreamVersionNoDictionary = 5;
+
+static inline bool IsSameConfig(const ZlingConfig& config1, const ZlingConfig& config2) {
+    return config1.block_size == config2.block_size
+        && config1.rolz_size == config2.rolz_size
+        && config1.bucket_size == config2.bucket_size
+        && config1.bucket_hash == config2.bucket_hash;
+}
+
+static inline bool IsSubBlockFlag(int encflag) {
+    int huffman_flag = encflag & ~kFlagRolzReuseTables;
+    return huffman_flag == kFlagRolzContinue || huffman_flag == kFlagRolzMultiStream || encflag == kFlagRolzStored;
+}
+
+/* sub-blocks with kFlagRolzReuseTables have no length tables, they are coded with the tables of
+ *  the previous HUFFMAN coded sub-block of the same block, and the decoder skips building decode
+ *  tables for them.
+ *  fresh tables have no code for unused symbols, which would soon prevent any reuse. so the encoder
+ *  codes with smoothed tables (with all symbols) when they cost at most 1/kReuseTablesSlack more than
+ *  fresh tables, and reuses tables under the same condition.
+ */
+static const int kReuseTablesSlack = 256;
+
+static inline int GetHuffmanHeaderLen(int encflag) {
+    return (encflag & kFlagRolzReuseTables) ? 0 : kHuffmanHeaderLen;
+}
+
+/* stored sub-blocks: olen (== rlen) raw bytes, without length tables. ROLZ buckets are still
+ *  updated with all stored positions.
+ *  the encoder decides to store a sub-block before ROLZ encoding it (so that ROLZ states of both
+ *  sides stay the same), when order-0 entropy of sampled bytes is close to 8 bits. this is only
+ *  checked on the first sub-block of a block and after badly compressed sub-blocks, since ROLZ
+ *  can still find long repeats in such data.
+ */
+static const int kStoredProbeStep = 4;
+static const double kStoredMinEntropy = 8 * 0.97;
+
+static bool IsIncompressible(const unsigned char* buf, int len) {
+    uint32_t freq_table[256] = {0};
+    int n = 0;
+    double bits = 0;
+
+    for (int i = 0; i < len; i += kStoredProbeStep) {
+        freq_table[buf[i]] += 1;
+        n += 1;
+    }
+    for (int i = 0; i < 256; i++) {
+        if (freq_table[i] > 0) {
+            bits -= freq_table[i] * std::log2(1.0 * freq_table[i] / n);
+        }
     }
+    return bits > kStoredMinEntropy * n;
+}
 
-    EncodeResource res;
-    int rlen;
-    int ilen;
-    int olen;
-    int encpos;
-    int current_level = level;
+/* multi-stream sub-blocks: symbols are split into kHuffmanStreams consecutive segments, each coded
+ *  as an independent bitstream so the decoder can run several decode chains at once. a jump table
+ *  with (tbuf start, obuf offset) of streams 1..N-1 follows the length tables.
+ */
+static inline int GetHuffmanStreams(int rlen) {
+    return rlen >= kHuffmanMultiStreamMinLen ? kHuffmanStreams : 1;
+}
+static inline void PutUInt32(unsigned char* buf, uint32_t v) {
+    buf[0] = v / 16777216 % 256;
+    buf[1] = v / 65536 % 256;
+    buf[2] = v / 256 % 256;
+    buf[3] = v / 1 % 256;
+}
+static inline uint32_t GetUInt32(const unsigned char* buf) {
+    return buf[0] * 16777216u + buf[1] * 65536u + buf[2] * 256u + buf[3];
+}
 
-    while (!inputter->IsEnd() && !inputter->IsErr()) {
-        rlen = 0;
-        ilen = 0;
-        olen = 0;
-        encpos = 0;
+static int ReadBlock(Inputter* inputter, unsigned char* ibuf, int block_size) {
+    int ilen = 0;
 
-        while(!inputter->IsEnd() && !inputter->IsErr() && ilen < kBlockSizeIn) {
-            ilen += inputter->GetData(res.ibuf + ilen, kBlockSizeIn - ilen);
-            CHECK_IO_ERROR(inputter);
+    while(!inputter->IsEnd() && !inputter->IsErr() && ilen < block_size) {
+        ilen += inputter->GetData(ibuf + ilen, block_size - ilen);
+    }
+    return ilen;
+}
+
+/* IsLiteral4: none of tbuf[0..3] is a match symbol */
+static inline bool IsLiteral4(const uint16_t* tbuf) {
+    return (tbuf[0] < 258) & (tbuf[1] < 258) & (tbuf[2] < 258) & (tbuf[3] < 258);
+}
+
+/* CountSymbols: build frequency tables of ROLZ output, runs of literals are counted 4 at a time. */
+static void CountSymbols(const uint16_t* tbuf, int rlen, uint32_t* freq_table1, uint32_t* freq_table2) {
+    int i = 0;
+
+    while (i < rlen) {
+        if (i + 4 <= rlen && IsLiteral4(tbuf + i)) {
+            freq_table1[tbuf[i + 0]] += 1;
+            freq_table1[tbuf[i + 1]] += 1;
+            freq_table1[tbuf[i + 2]] += 1;
+            freq_table1[tbuf[i + 3]] += 1;
+            i += 4;
+            continue;
+        }
+        freq_table1[tbuf[i]] += 1;
+        if (tbuf[i++] >= 258) {
+            freq_table2[matchidx_code[tbuf[i++]]] += 1;
+        }
+    }
+    return;
+}
+
+/* GetCodedSize: size of symbols counted in freq tables coded with length tables.
+ *  ret: HUFFMAN output size (without length tables and jump table)
+ *       -1: a counted symbol has no code
+ */
+static int GetCodedSize(const uint32_t* freq_table1, const uint32_t* freq_table2,
+                        const uint32_t* length_table1, const uint32_t* length_table2) {
+    uint64_t olen_bits = 0;
+
+    for (int i = 0; i < kHuffmanCodes1; i++) {
+        if (freq_table1[i] > 0 && length_table1[i] == 0) {
+            return -1;
+        }
+        olen_bits += freq_table1[i] * length_table1[i];
+    }
+    for (int i = 0; i < kHuffmanCodes2; i++) {
+        if (freq_table2[i] > 0 && length_table2[i] == 0) {
+            return -1;
         }
-        res.lzencoder->Reset();
+        olen_bits += freq_table2[i] * (length_table2[i] + matchidx_bitlen[i]);
+    }
+    return (olen_bits + 7) / 8;
+}
 
-        while (encpos < ilen) {
-            outputter->PutChar(kFlagRolzContinue);
-            CHECK_IO_ERROR(outputter);
+/* MakeLengthTables: HUFFMAN length tables of ROLZ output.
+ *  arg freq_table1/2: symbol counts (CountSymbols)
+ *  ret: HUFFMAN output size (without jump table)
+ */
+static int MakeLengthTables(const uint32_t* freq_table1, const uint32_t* freq_table2,
+                            uint32_t* length_table1, uint32_t* length_table2) {
+    ZlingMakeLengthTable(freq_table1, length_table1, kHuffmanCodes1, kHuffmanMaxLen1);
+    ZlingMakeLengthTable(freq_table2, length_table2, kHuffmanCodes2, kHuffmanMaxLen2);
+    return kHuffmanHeaderLen + GetCodedSize(freq_table1, freq_table2, length_table1, length_table2);
+}
 
-            // ROLZ encode
-            // ============================================================
-            int encpos_old = encpos;
-            rlen = res.lzencoder->Encode(current_level, res.ibuf, res.tbuf, ilen, kBlockSizeRolz, &encpos);
+/* MakeRolzPrices: prices of optimal parsing from HUFFMAN length tables of a sub-block.
+ *  symbols unused by the sub-block get the max code length. without tables (first sub-block of a
+ *  block), symbols cost 8 bits and match index codes 5 bits.
+ */
+static void MakeRolzPrices(const uint32_t* length_table1, const uint32_t* length_table2, ZlingRolzPrices* prices) {
+    for (int i = 0; i < kHuffmanCodes1; i++) {
+        if (length_table1 == NULL) {
+            prices->symbol[i] = 8;
+        } else {
+            prices->symbol[i] = (length_table1[i] > 0) ? length_table1[i] : kHuffmanMaxLen1;
+        }
+    }
+    for (int i = 0; i < kBucketItemSize; i++) {
+        uint32_t code = matchidx_code[i];
 
-            // HUFFMAN encode
-            // ============================================================
-            ZlingCodebuf codebuf;
-            int opos = 0;
-            uint32_t freq_table1[kHuffmanCodes1] = {0};
-            uint32_t freq_table2[kHuffmanCodes2] = {0};
-            uint32_t length_table1[kHuffmanCodes1 + (kHuffmanCodes1 % 2)] = {0};
-            uint32_t length_table2[kHuffmanCodes2 + (kHuffmanCodes2 % 2)] = {0};
-            uint16_t encode_table1[kHuffmanCodes1];
-            uint16_t encode_table2[kHuffmanCodes2];
-
-            for (int i = 0; i < rlen; i++) {
-                freq_table1[res.tbuf[i]] += 1;
-                if (res.tbuf[i] >= 258) {
-                    freq_table2[matchidx_code[res.tbuf[++i]]] += 1;
-                }
-            }
-            ZlingMakeLengthTable(freq_table1, length_table1, kHuffmanCodes1, kHuffmanMaxLen1);
-            ZlingMakeLengthTable(freq_table2, length_table2, kHuffmanCodes2, kHuffmanMaxLen2);
+        if (length_table2 == NULL) {
+            prices->matchidx[i] = 5 + matchidx_bitlen[code];
+        } else {
+            prices->matchidx[i] = ((length_table2[code] > 0) ? length_table2[code] : kHuffmanMaxLen2)
+                + matchidx_bitlen[code];
+        }
+    }
+    return;
+}
 
-            ZlingMakeEncodeTable(length_table1, encode_table1, kHuffmanCodes1, kHuffmanMaxLen1);
-            ZlingMakeEncodeTable(length_table2, encode_table2, kHuffmanCodes2, kHuffmanMaxLen2);
+/* EncodeSubBlockHuffman: HUFFMAN stage, sub-blocks can be processed by any thread. */
+static void EncodeSubBlockHuffman(EncodeSubBlock* sub) {
+    int opos = 0;
+    int streams = GetHuffmanStreams(sub->rlen);
+    int header_len = GetHuffmanHeaderLen(sub->encflag);
+    uint16_t encode_table1[kHuffmanCodes1];
+    uint16_t encode_table2[kHuffmanCodes2];
 
-            // write length table
-            for (int i = 0; i < kHuffmanCodes1; i += 2) {
-                res.obuf[opos++] = length_table1[i] * 16 + length_table1[i + 1];
-            }
-            for (int i = 0; i < kHuffmanCodes2; i += 2) {
-                res.obuf[opos++] = length_table2[i] * 16 + length_table2[i + 1];
-            }
+    ZlingMakeEncodeTable(sub->length_table1, encode_table1, kHuffmanCodes1, kHuffmanMaxLen1);
+    ZlingMakeEncodeTable(sub->length_table2, encode_table2, kHuffmanCodes2, kHuffmanMaxLen2);
+
+    // write length table
+    if (header_len > 0) {
+        for (int i = 0; i < kHuffmanCodes1; i += 2) {
+            sub->obuf[opos++] = sub->length_table1[i] * 16 + sub->length_table1[i + 1];
+        }
+        for (int i = 0; i < kHuffmanCodes2; i += 2) {
+            sub->obuf[opos++] = sub->length_table2[i] * 16 + sub->length_table2[i + 1];
+        }
+    }
+    opos += (streams - 1) * 8;  // jump table
 
-            // encode
-            for (int i = 0; i < rlen; i++) {
-                codebuf.Input(encode_table1[res.tbuf[i]], length_table1[res.tbuf[i]]);
-                if (res.tbuf[i] >= 258) {
-                    uint32_t code = matchidx_code[res.tbuf[++i]];
+    // encode, each stream ends at the first symbol boundary after its segment
+    for (int stream = 0, i = 0; stream < streams; stream++) {
+        int iend = (stream + 1 < streams) ? sub->rlen / streams * (stream + 1) : sub->rlen;
+        ZlingBitWriter writer(sub->obuf + opos);
 
-                    codebuf.Input(encode_table2[code], length_table2[code]);
-                    codebuf.Input(res.tbuf[i] - matchidx_base[code], matchidx_bitlen[code]);
-                }
-                if (codebuf.GetLength() >= 32) {
-                    res.obuf[opos++] = codebuf.Output(8);
-                    res.obuf[opos++] = codebuf.Output(8);
-                    res.obuf[opos++] = codebuf.Output(8);
-                    res.obuf[opos++] = codebuf.Output(8);
-                }
-            }
-            while (codebuf.GetLength() > 0) {
-                res.obuf[opos++] = codebuf.Output(8);
-            }
-            olen = opos;
+        if (stream > 0) {
+            PutUInt32(sub->obuf + header_len + (stream - 1) * 8 + 0, i);
+            PutUInt32(sub->obuf + header_len + (stream - 1) * 8 + 4, opos);
+        }
+        while (i < iend) {
+            const uint16_t* tbuf = sub->tbuf + i;
 
-            // lower level for uncompressible data
-            if (1.0 * olen / (encpos - encpos_old + 1) > 0.95) {
-                LIBZLING_DEBUG_COUNT("lz:uncompressible", 1);
-                current_level = 0;
-            } else {
-                current_level = level;
+            // a run of literals: 3 codes (<= 45 bits) fit between two flushes
+            if (i + 4 <= iend && IsLiteral4(tbuf)) {
+                writer.Input(encode_table1[tbuf[0]], sub->length_table1[tbuf[0]]);
+                writer.Input(encode_table1[tbuf[1]], sub->length_table1[tbuf[1]]);
+                writer.Input(encode_table1[tbuf[2]], sub->length_table1[tbuf[2]]);
+                writer.Flush();
+                writer.Input(encode_table1[tbuf[3]], sub->length_table1[tbuf[3]]);
+                writer.Flush();
+                i += 4;
+                continue;
             }
 
-            // outputter
-            outputter->PutUInt32(encpos); CHECK_IO_ERROR(outputter);
-            outputter->PutUInt32(rlen);   CHECK_IO_ERROR(outputter);
-            outputter->PutUInt32(olen);   CHECK_IO_ERROR(outputter);
+            // a single symbol: <= 15 + 8 + 8 bits
+            writer.Input(encode_table1[tbuf[0]], sub->length_table1[tbuf[0]]);
+            if (tbuf[0] >= 258) {
+                uint32_t code = matchidx_code[tbuf[1]];
 
-            for (int ooff = 0; !outputter->IsErr() && ooff < olen; ) {
-                ooff += outputter->PutData(res.obuf + ooff, olen - ooff);
-                CHECK_IO_ERROR(outputter);
+                writer.Input(encode_table2[code], sub->length_table2[code]);
+                writer.Input(tbuf[1] - matchidx_base[code], matchidx_bitlen[code]);
+                i++;
             }
+            writer.Flush();
+            i++;
         }
-        outputter->PutChar(kFlagRolzStop);
-        CHECK_IO_ERROR(outputter);
+        opos += writer.Finish();
+    }
+    sub->olen = opos;
+    return;
+}
+
+/* automatic levels (see libzling.h):
+ *  kAutoProbeWindows windows spread over a block are probed, each of kAutoProbeLen bytes at most and
+ *  1/kAutoProbeFraction of the block in all. windows with order-0 entropy close to 8 bits are skipped
+ *  (they are stored, see stored sub-blocks), others are ROLZ encoded with each level, and the level
+ *  minimizing
+ *    (100 - weight) * ln(cost) + weight * kAutoRatioScale * ln(size)
+ *  is used for the whole block. cost is the relative encoding time of a level (measured on text,
+ *  logs and binaries), size is the estimated output of all windows. the choice only depends on input
+ *  data, so output is still identical for any thread_num.
+ */
+static const int kAutoProbeLen = 16384;
+static const int kAutoProbeMinLen = 1024;  /* shorter windows are not probed, the level follows weight */
+static const int kAutoProbeWindows = 4;
+static const int kAutoProbeFraction = 64;
+static const int kAutoLevels = 5;
+static const double kAutoLevelCost[kAutoLevels] = {1.0, 1.1, 1.3, 1.5, 1.7};
+static const double kAutoRatioScale = 32.0;
 
-        if (action_handler) {
-            action_handler->OnProcess(res.ibuf, ilen);
+/* SelectLevel: choose a level for ibuf[0..ilen), must be called before EncodeBlock() resets ROLZ states. */
+static int SelectLevel(EncodeResource* res, unsigned char* ibuf, int ilen, int weight) {
+    int plen = std::min(ilen / kAutoProbeWindows / kAutoProbeFraction, kAutoProbeLen);
+    unsigned char* pbuf[kAutoProbeWindows];
+    uint16_t* tbuf = res->subblocks[0].tbuf;
+    uint32_t freq_table1[kHuffmanCodes1];
+    uint32_t freq_table2[kHuffmanCodes2];
+    uint32_t length_table1[kHuffmanCodes1 + (kHuffmanCodes1 % 2)];
+    uint32_t length_table2[kHuffmanCodes2 + (kHuffmanCodes2 % 2)];
+    int windows = 0;
+    int best_level = 0;
+    double best_score = 0.0;
+
+    if (weight <= 0) {
+        return 0;
+    }
+    if (plen < kAutoProbeMinLen) {  // a probe would cost more than a wrong choice
+        return (weight * (kAutoLevels - 1) + 50) / 100;
+    }
+    for (int i = 0; i < kAutoProbeWindows; i++) {
+        unsigned char* window = ibuf + (ilen - plen) / (kAutoProbeWindows - 1) * i;
+
+        if (!IsIncompressible(window, plen)) {
+            pbuf[windows++] = window;
         }
     }
+    if (windows == 0) {
+        return 0;
+    }
 
-EncodeOrDecodeFinished:
-    if (action_handler) {
-        action_handler->OnDone();
+    // contexts are reset once, each trial encode is rewound instead
+    res->lzencoder->Reset();
+    for (int level = 0; level < kAutoLevels; level++) {
+        uint64_t olen = 0;
+        uint64_t encpos_total = 0;
+        double score;
+
+        for (int i = 0; i < windows; i++) {
+            int encpos = 0;
+            int rlen;
+
+            rlen = res->lzencoder->Encode(level, pbuf[i], tbuf, plen, res->config.rolz_size, &encpos);
+            res->lzencoder->Rewind(pbuf[i], plen, encpos);
+            memset(freq_table1, 0, sizeof(freq_table1));
+            memset(freq_table2, 0, sizeof(freq_table2));
+            CountSymbols(tbuf, rlen, freq_table1, freq_table2);
+            olen += MakeLengthTables(freq_table1, freq_table2, length_table1, length_table2);
+            encpos_total += encpos;
+        }
+        score = (100 - weight) * std::log(kAutoLevelCost[level])
+            + weight * kAutoRatioScale * std::log(1.0 * olen / encpos_total);
+
+        if (level == 0 || score < best_score) {
+            best_level = level;
+            best_score = score;
+        }
     }
-    return (inputter->IsErr() || outputter->IsErr()) ? -1 : 0;
+    LIBZLING_DEBUG_COUNT("lz:auto_level", best_level);
+    return best_level;
 }
 
-int Decode(Inputter* inputter, Outputter* outputter, ActionHandler* action_handler) {
-    if (action_handler) {
-        action_handler->SetInputterOutputter(inputter, outputter, false);
-        action_handler->OnInit();
+/* EncodeBlock: encode ibuf[0..ilen) as an independent block (starting after the dictionary).
+ *  the ROLZ stage carries state between sub-blocks and runs in the calling thread, HUFFMAN
+ *  stages are passed to pool (if not NULL) and overlap with the ROLZ stage of next sub-blocks.
+ *
+ *  ret: -1: I/O error
+ *        0: success
+ */
+static int EncodeBlock(EncodeResource* res, int ilen, int level, Outputter* outputter,
+                       thread::ZlingThreadPool* pool) {
+    int encpos = 0;
+    int current_level = level;
+    bool check_stored = true;
+    bool has_tables = false;
+    int nrolz = 0;
+    int nhuffman = 0;
+    uint32_t reuse_table1[kHuffmanCodes1 + (kHuffmanCodes1 % 2)];
+    uint32_t reuse_table2[kHuffmanCodes2 + (kHuffmanCodes2 % 2)];
+
+    if (level >= kLevelAuto) {
+        int dict_len = res->GetDictionaryLen();
+        level = current_level = SelectLevel(res, res->ibuf + dict_len, ilen - dict_len,
+                                            std::min(level - kLevelAuto, 100));
     }
+    res->lzencoder->Reset();
 
-    DecodeResource res;
-    int rlen;
-    int olen;
-    int encflag;
-    int encpos;
-    int decpos;
+    if (res->dictionary != NULL) {  // buckets are primed like a stored sub-block, which is not output
+        res->lzencoder->Prime(res->dictionary->rolz);
+        res->lzencoder->EncodeStored(res->ibuf, ilen, res->GetDictionaryLen(), &encpos);
+        memcpy(reuse_table1, res->dictionary->length_table1, sizeof(reuse_table1));
+        memcpy(reuse_table2, res->dictionary->length_table2, sizeof(reuse_table2));
+        has_tables = true;
+    }
 
-    while (!inputter->IsEnd()) {
-        olen = 0;
-        rlen = 0;
-        decpos = 0;
-        res.lzdecoder->Reset();
+    if (level == 5) {  // blocks are independent, so are their prices
+        ZlingRolzPrices prices;
 
-        while (!inputter->IsEnd()) {
-            encflag = inputter->GetChar();
+        MakeRolzPrices(has_tables ? reuse_table1 : NULL, has_tables ? reuse_table2 : NULL, &prices);
+        res->lzencoder->SetPrices(prices);
+    }
 
-            if (encflag != kFlagRolzStop && encflag != kFlagRolzContinue) { /* error: invalid encflag */
-                throw std::runtime_error("baidu::zling::Decode(): invalid encflag.");
-            }
-            if (encflag == kFlagRolzStop) {
-                break;
-            }
+    while (encpos < ilen || nhuffman < nrolz) {
+        if (encpos < ilen && nrolz - nhuffman < res->subblock_num) {
+            EncodeSubBlock* sub = &res->subblocks[nrolz++ % res->subblock_num];
 
-            encpos = inputter->GetUInt32(); CHECK_IO_ERROR(inputter);
-            rlen   = inputter->GetUInt32(); CHECK_IO_ERROR(inputter);
-            olen   = inputter->GetUInt32(); CHECK_IO_ERROR(inputter);
+            // stored sub-block, without ROLZ and HUFFMAN encoding
+            // ============================================================
+            int encpos_old = encpos;
+            int stored_len = std::min(ilen - encpos, res->config.rolz_size);
 
-            if (rlen > kBlockSizeRolz || olen > kBlockSizeHuffman) {
-                throw std::runtime_error("baidu::zling::Decode(): invalid block size.");
-            }
-            for (int ooff = 0; !inputter->IsEnd() && ooff < olen; ) {
-                ooff += inputter->GetData(res.obuf + ooff, olen - ooff);
-                CHECK_IO_ERROR(inputter);
+            if (check_stored && IsIncompressible(res->ibuf + encpos, stored_len)) {
+                LIBZLING_DEBUG_COUNT("lz:stored", 1);
+                res->lzencoder->EncodeStored(res->ibuf, ilen, stored_len, &encpos);
+                memcpy(sub->obuf, res->ibuf + encpos_old, stored_len);
+                sub->encflag = kFlagRolzStored;
+                sub->encpos = encpos;
+                sub->rlen = stored_len;
+                sub->olen = stored_len;
+                current_level = std::min(level, 0);
+                continue;
             }
 
-            // HUFFMAN DECODE
+            // ROLZ encode
             // ============================================================
-            ZlingCodebuf codebuf;
-            int opos = 0;
-            uint32_t length_table1[kHuffmanCodes1 + (kHuffmanCodes1 % 2)] = {0};
-            uint32_t length_table2[kHuffmanCodes2 + (kHuffmanCodes2 % 2)] = {0};
-            uint16_t decode_table1[1 << kHuffmanMaxLen1];
-            uint16_t decode_table2[1 << kHuffmanMaxLen2];
-            uint16_t decode_table1_fast[1 << kHuffmanMaxLen1Fast];
-            uint16_t encode_table1[kHuffmanCodes1];
-            uint16_t encode_table2[kHuffmanCodes2];
-
-            // read length table
-            for (int i = 0; i < kHuffmanCodes1; i += 2) {
-                length_table1[i + 0] = res.obuf[opos] / 16;
-                length_table1[i + 1] = res.obuf[opos] % 16;
-                opos++;
-            }
-            for (int i = 0; i < kHuffmanCodes2; i += 2) {
-                length_table2[i + 0] = res.obuf[opos] / 16;
-                length_table2[i + 1] = res.obuf[opos] % 16;
-                opos++;
-            }
-            ZlingMakeEncodeTable(length_table1, encode_table1, kHuffmanCodes1, kHuffmanMaxLen1);
-            ZlingMakeEncodeTable(length_table2, encode_table2, kHuffmanCodes2, kHuffmanMaxLen2);
-
-            // decode_table1: 2-level decode table
-            ZlingMakeDecodeTable(length_table1, encode_table1, decode_table1, kHuffmanCodes1, kHuffmanMaxLen1);
-            ZlingMakeDecodeTable(length_table1, encode_table1, decode_table1_fast, kHuffmanCodes1, kHuffmanMaxLen1Fast);
-
-            // decode_table2: 1-level decode table
-            ZlingMakeDecodeTable(length_table2, encode_table2, decode_table2, kHuffmanCodes2, kHuffmanMaxLen2);
-
-            // decode
-            for (int i = 0; i < rlen; i++) {
-                if (codebuf.GetLength() < 32) {
-                    codebuf.Input(res.obuf[opos++], 8);
-                    codebuf.Input(res.obuf[opos++], 8);
-                    codebuf.Input(res.obuf[opos++], 8);
-                    codebuf.Input(res.obuf[opos++], 8);
+            sub->rlen = res->lzencoder->Encode(current_level, res->ibuf, sub->tbuf, ilen, res->config.rolz_size,
+                                              &encpos);
+            sub->encpos = encpos;
+
+            // HUFFMAN length table, output size is known before encoding
+            // ============================================================
+            uint32_t freq_table1[kHuffmanCodes1] = {0};
+            uint32_t freq_table2[kHuffmanCodes2] = {0};
+            bool reuse_tables = false;
+
+            CountSymbols(sub->tbuf, sub->rlen, freq_table1, freq_table2);
+            int olen_estimated = MakeLengthTables(freq_table1, freq_table2, sub->length_table1, sub->length_table2);
+
+            if (has_tables) {  // tables of the previous sub-block are close enough?
+                int olen_reused = GetCodedSize(freq_table1, freq_table2, reuse_table1, reuse_table2);
+
+                if (olen_reused != -1 && olen_reused <= olen_estimated + olen_estimated / kReuseTablesSlack) {
+                    LIBZLING_DEBUG_COUNT("huffman:reuse_tables", 1);
+                    memcpy(sub->length_table1, reuse_table1, sizeof(reuse_table1));
+                    memcpy(sub->length_table2, reuse_table2, sizeof(reuse_table2));
+                    olen_estimated = olen_reused;
+                    reuse_tables = true;
                 }
+            }
+            if (!reuse_tables) {
+                uint32_t smoothed_freq_table1[kHuffmanCodes1];
+                uint32_t smoothed_freq_table2[kHuffmanCodes2];
+                int olen_smoothed;
 
-                res.tbuf[i] = decode_table1_fast[codebuf.Peek(kHuffmanMaxLen1Fast)];
-                if (res.tbuf[i] == uint16_t(-1)) {
-                    res.tbuf[i] = decode_table1[codebuf.Peek(kHuffmanMaxLen1)];
+                for (int i = 0; i < kHuffmanCodes1; i++) {
+                    smoothed_freq_table1[i] = freq_table1[i] * 2 + 1;
                 }
+                for (int i = 0; i < kHuffmanCodes2; i++) {
+                    smoothed_freq_table2[i] = freq_table2[i] * 2 + 1;
+                }
+                MakeLengthTables(smoothed_freq_table1, smoothed_freq_table2, reuse_table1, reuse_table2);
+                olen_smoothed = kHuffmanHeaderLen + GetCodedSize(freq_table1, freq_table2, reuse_table1, reuse_table2);
 
-                if (res.tbuf[i] >= kHuffmanCodes1) { /* error: literal/length >= kHuffmanCodes1 */
-                    throw std::runtime_error("baidu::zling::Decode(): invalid huffman stream. (bad code1)");
+                if (olen_smoothed <= olen_estimated + olen_estimated / kReuseTablesSlack) {
+                    memcpy(sub->length_table1, reuse_table1, sizeof(reuse_table1));
+                    memcpy(sub->length_table2, reuse_table2, sizeof(reuse_table2));
+                    olen_estimated = olen_smoothed;
+                } else {
+                    memcpy(reuse_table1, sub->length_table1, sizeof(reuse_table1));
+                    memcpy(reuse_table2, sub->length_table2, sizeof(reuse_table2));
                 }
-                codebuf.Output(length_table1[res.tbuf[i]]);
+                has_tables = true;
+            }
 
-                if (res.tbuf[i] >= 258) {
-                    uint32_t code;
-                    uint32_t bits;
+            // optimal parsing of next sub-block is priced with these tables
+            if (level == 5) {
+                ZlingRolzPrices prices;
 
-                    /* error: matchidx.code >= kHuffmanCodes2 */
-                    if((code = decode_table2[codebuf.Peek(kHuffmanMaxLen2)]) >= kHuffmanCodes2) {
-                        throw std::runtime_error("baidu::zling::Decode(): invalid huffman stream. (bad code2)");
-                    }
-                    codebuf.Output(length_table2[code]);
-                    bits = codebuf.Output(matchidx_bitlen[code]);
+                MakeRolzPrices(sub->length_table1, sub->length_table2, &prices);
+                res->lzencoder->SetPrices(prices);
+            }
 
-                    /* error: matchidx >= kBucketItemSize */
-                    if ((res.tbuf[++i] = matchidx_base[code] + bits) >= kBucketItemSize) {
-                        throw std::runtime_error("baidu::zling::Decode(): invalid huffman stream. (bad ex-bits)");
-                    }
-                }
+            // lower level for uncompressible data
+            if (1.0 * olen_estimated / (encpos - encpos_old + 1) > 0.95) {
+                LIBZLING_DEBUG_COUNT("lz:uncompressible", 1);
+                current_level = std::min(level, 0);
+                check_stored = true;
+            } else {
+                current_level = level;
+                check_stored = false;
             }
+            sub->encflag = GetHuffmanStreams(sub->rlen) > 1 ? kFlagRolzMultiStream : kFlagRolzContinue;
+            sub->encflag |= reuse_tables ? kFlagRolzReuseTables : 0;
 
-            // ROLZ decode
+            // HUFFMAN encode
             // ============================================================
-            if (res.lzdecoder->Decode(res.tbuf, res.ibuf, rlen, encpos, &decpos) == -1) { /* error: lz.Decode failed */
-                throw std::runtime_error("baidu::zling::Decode(): lzdecode failed.");
+            if (pool != NULL) {
+                sub->done = pool->Submit(std::bind(EncodeSubBlockHuffman, sub), true);
+            } else {
+                EncodeSubBlockHuffman(sub);
             }
+            continue;
         }
 
-        // output
-        for (int ioff = 0; !outputter->IsErr() && ioff < decpos; ) {
-            ioff += outputter->PutData(res.ibuf + ioff, decpos - ioff);
-            CHECK_IO_ERROR(outputter);
+        // outputter
+        EncodeSubBlock* sub = &res->subblocks[nhuffman++ % res->subblock_num];
+        if (pool != NULL && sub->encflag != kFlagRolzStored) {
+            pool->Wait(sub->done);
         }
+        outputter->PutChar(sub->encflag);
+        CHECK_IO_ERROR(outputter);
+        outputter->PutUInt32(sub->encpos); CHECK_IO_ERROR(outputter);
+        outputter->PutUInt32(sub->rlen);   CHECK_IO_ERROR(outputter);
+        outputter->PutUInt32(sub->olen);   CHECK_IO_ERROR(outputter);
 
-        if (action_handler) {
-            action_handler->OnProcess(res.ibuf, decpos);
+        for (int ooff = 0; !outputter->IsErr() && ooff < sub->olen; ) {
+            ooff += outputter->PutData(sub->obuf + ooff, sub->olen - ooff);
+            CHECK_IO_ERROR(outputter);
         }
     }
+    outputter->PutChar(kFlagRolzStop);
+    CHECK_IO_ERROR(outputter);
+    return 0;
 
 EncodeOrDecodeFinished:
-    if (action_handler) {
-        action_handler->OnDone();
+    return -1;
+}
+
+static const uint32_t kDecodeEntryInvalid = uint32_t(-1);
+
+static void MakeDecodeTable1Fast(DecodeTables* tables, const uint16_t* encode_table1) {
+    uint32_t* table = tables->decode_table1_fast;
+
+    // one symbol per entry
+    std::fill(&table[0], &table[1 << kHuffmanMaxLen1Fast], kDecodeEntryInvalid);
+    for (int c = 0; c < kHuffmanCodes1; c++) {
+        uint32_t len = tables->length_table1[c];
+
+        if (len > 0 && len <= uint32_t(kHuffmanMaxLen1Fast)) {
+            for (int i = encode_table1[c]; i < (1 << kHuffmanMaxLen1Fast); i += (1 << len)) {
+                table[i] = c | len << 19 | len << 23;
+            }
+        }
     }
-    return (inputter->IsErr() || outputter->IsErr()) ? -1 : 0;
+
+    // append a second literal/word symbol when both codes fit
+    for (int i = 0; i < (1 << kHuffmanMaxLen1Fast); i++) {
+        uint32_t sym1 = table[i] & 0x3ff;
+        uint32_t len1 = table[i] >> 19 & 15;
+
+        if (table[i] != kDecodeEntryInvalid && sym1 < 258) {
+            uint32_t next = table[i >> len1];
+            uint32_t sym2 = next & 0x3ff;
+            uint32_t len2 = next >> 19 & 15;
+
+            if (next != kDecodeEntryInvalid && sym2 < 258 && len1 + len2 <= uint32_t(kHuffmanMaxLen1Fast)) {
+                table[i] = sym1 | sym2 << 10 | len1 << 19 | (len1 + len2) << 23 | 1 << 27;
+            }
+        }
+    }
+    return;
+}
+
+static void MakeDecodeTable2(DecodeTables* tables, const uint16_t* encode_table2) {
+    uint32_t* table = tables->decode_table2;
+
+    std::fill(&table[0], &table[1 << kHuffmanMatchIdxLen], kDecodeEntryInvalid);
+    for (int c = 0; c < kHuffmanCodes2; c++) {
+        uint32_t len = tables->length_table2[c];
+
+        if (len > 0 && len <= uint32_t(kHuffmanMaxLen2)) {
+            if (len + matchidx_bitlen[c] <= uint32_t(kHuffmanMatchIdxLen)) {  // resolve ex-bits in the table
+                uint32_t fulllen = len + matchidx_bitlen[c];
+
+                for (uint32_t bits = 0; bits < (1u << matchidx_bitlen[c]); bits++) {
+                    for (int i = encode_table2[c] | bits << len; i < (1 << kHuffmanMatchIdxLen); i += (1 << fulllen)) {
+                        table[i] = (matchidx_base[c] + bits) | fulllen << 16;
+                    }
+                }
+            } else {
+                for (int i = encode_table2[c]; i < (1 << kHuffmanMatchIdxLen); i += (1 << len)) {
+                    table[i] = matchidx_base[c] | len << 16 | matchidx_bitlen[c] << 24;
+                }
+            }
+        }
+    }
+    return;
+}
+
+/* DecodeSymbol: decode one literal/word/match symbol of a bitstream into tbuf[i].
+ *  with kMultiSymbol, a second literal/word symbol may be decoded at the same time, so tbuf[i + 1]
+ *  must still belong to the stream.
+ */
+template<bool kMultiSymbol>
+static inline void DecodeSymbol(const DecodeTables* tables, ZlingBitReader* codebuf, uint16_t* tbuf, int* i) {
+    codebuf->Refill();  // a symbol takes at most 15 + 8 + 8 bits
+
+    uint32_t entry = tables->decode_table1_fast[codebuf->Peek(kHuffmanMaxLen1Fast)];
+    uint32_t sym;
+
+    if (entry != kDecodeEntryInvalid) {
+        uint32_t nsym = kMultiSymbol ? 1 + (entry >> 27) : 1;
+
+        sym = entry & 0x3ff;
+        codebuf->Output(entry >> (kMultiSymbol ? 23 : 19) & 15);
+        tbuf[i[0] + 0] = sym;
+        if (kMultiSymbol) {
+            tbuf[i[0] + 1] = entry >> 10 & 0x1ff;  // overwritten by the match index if sym is a match
+        }
+        i[0] += nsym;
+
+    } else {
+        sym = tables->decode_table1[codebuf->Peek(kHuffmanMaxLen1)];
+        if (sym >= kHuffmanCodes1) { /* error: literal/length >= kHuffmanCodes1 */
+            throw std::runtime_error("baidu::zling::Decode(): invalid huffman stream. (bad code1)");
+        }
+        codebuf->Output(tables->length_table1[sym]);
+        tbuf[i[0]++] = sym;
+    }
+
+    if (sym >= 258) {
+        /* error: matchidx.code >= kHuffmanCodes2 */
+        if ((entry = tables->decode_table2[codebuf->Peek(kHuffmanMatchIdxLen)]) == kDecodeEntryInvalid) {
+            throw std::runtime_error("baidu::zling::Decode(): invalid huffman stream. (bad code2)");
+        }
+        codebuf->Output(entry >> 16 & 0xff);
+
+        /* error: matchidx >= kBucketItemSize */
+        if ((tbuf[i[0]++] = (entry & 0xffff) + codebuf->Output(entry >> 24)) >= kBucketItemSize) {
+            throw std::runtime_error("baidu::zling::Decode(): invalid huffman stream. (bad ex-bits)");
+        }
+    }
+    return;
+}
+
+/* DecodeStreams: decode all bitstreams of a sub-block, keep independent decode chains in flight. */
+static inline void DecodeStreams(const DecodeTables* tables, ZlingBitReader* codebuf, uint16_t* tbuf,
+                                 int* ipos,
+                                 const int* iend,
+                                 int streams) {
+    if (streams == 4) {
+        while (ipos[0] + 1 < iend[0] && ipos[1] + 1 < iend[1] && ipos[2] + 1 < iend[2] && ipos[3] + 1 < iend[3]) {
+            DecodeSymbol<true>(tables, &codebuf[0], tbuf, &ipos[0]);
+            DecodeSymbol<true>(tables, &codebuf[1], tbuf, &ipos[1]);
+            DecodeSymbol<true>(tables, &codebuf[2], tbuf, &ipos[2]);
+            DecodeSymbol<true>(tables, &codebuf[3], tbuf, &ipos[3]);
+        }
+    }
+    for (int stream = 0; stream < streams; stream++) {
+        while (ipos[stream] + 1 < iend[stream]) {
+            DecodeSymbol<true>(tables, &codebuf[stream], tbuf, &ipos[stream]);
+        }
+        while (ipos[stream] < iend[stream]) {
+            DecodeSymbol<false>(tables, &codebuf[stream], tbuf, &ipos[stream]);
+        }
+        if (ipos[stream] != iend[stream]) { /* error: symbol crosses stream end */
+            throw std::runtime_error("baidu::zling::Decode(): invalid huffman stream. (bad stream end)");
+        }
+    }
+    return;
+}
+
+typedef void (*DecodeStreamsFunc)(const DecodeTables*, ZlingBitReader*, uint16_t*, int*, const int*, int);
+
+static void DecodeStreamsGeneric(const DecodeTables* tables, ZlingBitReader* codebuf, uint16_t* tbuf,
+                                 int* ipos,
+                                 const int* iend,
+                                 int streams) {
+    DecodeStreams(tables, codebuf, tbuf, ipos, iend, streams);
+}
+
+#if LIBZLING_X86_DISPATCH
+/* same code with everything inlined and compiled for BMI2, so Peek()/Output() use BZHI/SHRX */
+__attribute__((target("bmi2"), flatten))
+static void DecodeStreamsBMI2(const DecodeTables* tables, ZlingBitReader* codebuf, uint16_t* tbuf,
+                              int* ipos,
+                              const int* iend,
+                              int streams) {
+    DecodeStreams(tables, codebuf, tbuf, ipos, iend, streams);
+}
+#endif
+
+static DecodeStreamsFunc SelectDecodeStreams() {
+#if LIBZLING_X86_DISPATCH
+    if (cpu::GetCpuFeatures().bmi2) {
+        return DecodeStreamsBMI2;
+    }
+#endif
+    return DecodeStreamsGeneric;
+}
+
+static const DecodeStreamsFunc DecodeStreamsKernel = SelectDecodeStreams();
+
+/* MakeDecodeTables: build decode tables from tables->length_table1/2. */
+static void MakeDecodeTables(DecodeTables* tables) {
+    uint16_t encode_table1[kHuffmanCodes1];
+    uint16_t encode_table2[kHuffmanCodes2];
+
+    ZlingMakeEncodeTable(tables->length_table1, encode_table1, kHuffmanCodes1, kHuffmanMaxLen1);
+    ZlingMakeEncodeTable(tables->length_table2, encode_table2, kHuffmanCodes2, kHuffmanMaxLen2);
+
+    // decode_table1: 2-level decode table
+    ZlingMakeDecodeTable(tables->length_table1, encode_table1, tables->decode_table1, kHuffmanCodes1, kHuffmanMaxLen1);
+    MakeDecodeTable1Fast(tables, encode_table1);
+
+    // decode_table2: 1-level decode table, with ex-bits
+    MakeDecodeTable2(tables, encode_table2);
+    return;
+}
+
+/* MakeDecodeTables: read length tables of a sub-block and build its decode tables. */
+static void MakeDecodeTables(const unsigned char* header, DecodeTables* tables) {
+    // read length table
+    for (int i = 0; i < kHuffmanCodes1; i += 2) {
+        tables->length_table1[i + 0] = header[0] / 16;
+        tables->length_table1[i + 1] = header[0] % 16;
+        header++;
+    }
+    for (int i = 0; i < kHuffmanCodes2; i += 2) {
+        tables->length_table2[i + 0] = header[0] / 16;
+        tables->length_table2[i + 1] = header[0] % 16;
+        header++;
+    }
+    MakeDecodeTables(tables);
+    return;
+}
+
+ZlingDictionary::Impl::Impl(const unsigned char* data, size_t size):
+    rolz(data, size),
+    id(ComputeAdler32(data, size)) {
+    std::vector<unsigned char> ibuf(data, data + size);
+    std::vector<uint16_t> tbuf(kBlockSizeRolz + kSentinelLen);
+    ZlingRolzEncoder lzencoder(kBucketItemSize, kBucketItemHash, std::max(Log2(size), 1));
+    uint32_t freq_table1[kHuffmanCodes1] = {0};
+    uint32_t freq_table2[kHuffmanCodes2] = {0};
+    int encpos = 0;
+
+    // MTF tables and HUFFMAN tables of the dictionary coded by itself (level 0), HUFFMAN tables are
+    // smoothed like tables kept for reuse
+    ibuf.resize(size + kSentinelLen);
+    while (encpos < int(size)) {
+        int rlen = lzencoder.Encode(0, ibuf.data(), tbuf.data(), size, kBlockSizeRolz, &encpos);
+        CountSymbols(tbuf.data(), rlen, freq_table1, freq_table2);
+    }
+    for (int i = 0; i < kHuffmanCodes1; i++) {
+        freq_table1[i] = freq_table1[i] * 2 + 1;
+    }
+    for (int i = 0; i < kHuffmanCodes2; i++) {
+        freq_table2[i] = freq_table2[i] * 2 + 1;
+    }
+    MakeLengthTables(freq_table1, freq_table2, length_table1, length_table2);
+    lzencoder.Snapshot(&rolz);
+
+    memcpy(tables.length_table1, length_table1, sizeof(length_table1));
+    memcpy(tables.length_table2, length_table2, sizeof(length_table2));
+    MakeDecodeTables(&tables);
+}
+
+/* DecodeSubBlockHuffman: HUFFMAN stage, sub-blocks can be processed by any thread.
+ *  sub->tables are built (MakeDecodeTables) before, they may be shared with other sub-blocks.
+ */
+static void DecodeSubBlockHuffman(DecodeSubBlock* sub) {
+    ZlingBitReader codebuf[kHuffmanStreams];
+    int header_len = GetHuffmanHeaderLen(sub->encflag);
+    int streams = ((sub->encflag & ~kFlagRolzReuseTables) == kFlagRolzMultiStream) ? kHuffmanStreams : 1;
+    int ipos[kHuffmanStreams];
+    int iend[kHuffmanStreams];
+    int opos[kHuffmanStreams];
+
+    // read jump table
+    ipos[0] = 0;
+    opos[0] = header_len + (streams - 1) * 8;
+    for (int stream = 1; stream < streams; stream++) {
+        ipos[stream] = GetUInt32(sub->obuf + header_len + (stream - 1) * 8 + 0);
+        opos[stream] = GetUInt32(sub->obuf + header_len + (stream - 1) * 8 + 4);
+        iend[stream - 1] = ipos[stream];
+
+        /* error: bad jump table */
+        if (ipos[stream] < ipos[stream - 1] || ipos[stream] > sub->rlen ||
+            opos[stream] < opos[stream - 1] || opos[stream] > sub->olen) {
+            throw std::runtime_error("baidu::zling::Decode(): invalid huffman stream. (bad jump table)");
+        }
+    }
+    iend[streams - 1] = sub->rlen;
+
+    // decode
+    for (int stream = 0; stream < streams; stream++) {
+        codebuf[stream].Init(sub->obuf + opos[stream], sub->obuf + sub->olen);
+    }
+    DecodeStreamsKernel(sub->tables, codebuf, sub->tbuf, ipos, iend, streams);
+    return;
+}
+
+/* DecodeBlock: decode a block starting with encflag into ibuf[0..decpos) (starting after the dictionary).
+ *  sub-blocks are read in the calling thread, HUFFMAN stages are passed to pool (if not NULL)
+ *  and overlap with the ROLZ stage of previous sub-blocks.
+ *
+ *  ret: -1: I/O error
+ *        0: success
+ */
+static int DecodeBlock(DecodeResource* res, Inputter* inputter, int encflag, int* decpos,
+                       thread::ZlingThreadPool* pool) {
+    int nhuffman = 0;
+    int nrolz = 0;
+    int ntables = 0;
+    const DecodeTables* tables = NULL;  /* tables of the previous HUFFMAN coded sub-block */
+
+    decpos[0] = 0;
+
+    if (res->dictionary != NULL) {
+        res->lzdecoder->Prime(res->dictionary->rolz);
+        res->lzdecoder->DecodeStored(res->dictionary->rolz.data.data(), res->ibuf, res->GetDictionaryLen(),
+                                     res->GetDictionaryLen(), decpos);
+        tables = &res->dictionary->tables;
+    }
+
+    while (encflag != kFlagRolzStop || nrolz < nhuffman) {
+        if (encflag != kFlagRolzStop && nhuffman - nrolz < res->subblock_num) {
+            DecodeSubBlock* sub = &res->subblocks[nhuffman++ % res->subblock_num];
+
+            if (!IsSubBlockFlag(encflag)) { /* error: invalid encflag */
+                throw std::runtime_error("baidu::zling::Decode(): invalid encflag.");
+            }
+            sub->encflag = encflag;
+            sub->encpos = inputter->GetUInt32(); CHECK_IO_ERROR(inputter);
+            sub->rlen   = inputter->GetUInt32(); CHECK_IO_ERROR(inputter);
+            sub->olen   = inputter->GetUInt32(); CHECK_IO_ERROR(inputter);
+
+            if (sub->encpos > res->config.block_size ||
+                sub->rlen > res->config.rolz_size ||
+                sub->olen > GetBlockSizeHuffman(res->config.rolz_size) ||
+                (encflag == kFlagRolzStored && sub->rlen != sub->olen)) {
+                throw std::runtime_error("baidu::zling::Decode(): invalid block size.");
+            }
+            for (int ooff = 0; !inputter->IsEnd() && ooff < sub->olen; ) {
+                ooff += inputter->GetData(sub->obuf + ooff, sub->olen - ooff);
+                CHECK_IO_ERROR(inputter);
+            }
+            memset(sub->obuf + sub->olen, 0, 8);  // bitreader padding, inside kSentinelLen
+
+            // HUFFMAN DECODE
+            // ============================================================
+            // tables are built here, so that sub-blocks reusing them can be decoded by any thread.
+            // a table is overwritten subblock_num tables later, all its sub-blocks are done then.
+            if (encflag == kFlagRolzStored) {
+                // nothing to decode
+            } else if (encflag & kFlagRolzReuseTables) {
+                if (tables == NULL) { /* error: no tables to reuse */
+                    throw std::runtime_error("baidu::zling::Decode(): invalid encflag.");
+                }
+                sub->tables = tables;
+            } else {
+                DecodeTables* new_tables = &res->tables[ntables++ % res->subblock_num];
+
+                MakeDecodeTables(sub->obuf, new_tables);
+                sub->tables = tables = new_tables;
+            }
+
+            if (encflag == kFlagRolzStored) {
+                // nothing to decode
+            } else if (pool != NULL) {
+                sub->done = pool->Submit(std::bind(DecodeSubBlockHuffman, sub), true);
+            } else {
+                DecodeSubBlockHuffman(sub);
+            }
+
+            if (inputter->IsEnd()) {
+                encflag = kFlagRolzStop;
+                continue;
+            }
+            encflag = inputter->GetChar();
+            CHECK_IO_ERROR(inputter);
+            continue;
+        }
+
+        // ROLZ decode
+        // ============================================================
+        DecodeSubBlock* sub = &res->subblocks[nrolz++ % res->subblock_num];
+        if (sub->encflag == kFlagRolzStored) {
+            if (res->lzdecoder->DecodeStored(sub->obuf, res->ibuf, sub->olen, sub->encpos, decpos) == -1) {
+                throw std::runtime_error("baidu::zling::Decode(): lzdecode failed."); /* error: lz.Decode failed */
+            }
+            continue;
+        }
+        if (pool != NULL) {
+            pool->Wait(sub->done);
+        }
+        if (res->lzdecoder->Decode(sub->tbuf, res->ibuf, sub->rlen, sub->encpos, decpos) == -1) {
+            throw std::runtime_error("baidu::zling::Decode(): lzdecode failed."); /* error: lz.Decode failed */
+        }
+    }
+    return 0;
+
+EncodeOrDecodeFinished:
+    return -1;
+}
+
+/* ScanBlock: copy a block starting with encflag into buf without decoding it.
+ *  ret: -1: I/O error
+ *        0: success
+ */
+static int ScanBlock(Inputter* inputter, int encflag, const ZlingConfig& config, std::vector<unsigned char>* buf) {
+    MemoryOutputter block_outputter(buf);
+    uint32_t rlen;
+    uint32_t olen;
+
+    buf->clear();
+    block_outputter.PutChar(encflag);
+
+    while (encflag != kFlagRolzStop) {
+        if (!IsSubBlockFlag(encflag)) { /* error: invalid encflag */
+            throw std::runtime_error("baidu::zling::Decode(): invalid encflag.");
+        }
+        block_outputter.PutUInt32(inputter->GetUInt32()); CHECK_IO_ERROR(inputter);
+        block_outputter.PutUInt32(rlen = inputter->GetUInt32()); CHECK_IO_ERROR(inputter);
+        block_outputter.PutUInt32(olen = inputter->GetUInt32()); CHECK_IO_ERROR(inputter);
+
+        if (rlen > uint32_t(config.rolz_size) || olen > uint32_t(GetBlockSizeHuffman(config.rolz_size))) {
+            throw std::runtime_error("baidu::zling::Decode(): invalid block size.");
+        }
+        size_t ooff = buf->size();
+        buf->resize(ooff + olen);
+
+        while (!inputter->IsEnd() && ooff < buf->size()) {
+            ooff += inputter->GetData(&buf->at(ooff), buf->size() - ooff);
+            CHECK_IO_ERROR(inputter);
+        }
+        buf->resize(ooff);
+
+        if (inputter->IsEnd()) {
+            break;
+        }
+        encflag = inputter->GetChar();
+        CHECK_IO_ERROR(inputter);
+        block_outputter.PutChar(encflag);
+    }
+    return 0;
+
+EncodeOrDecodeFinished:
+    return -1;
+}
+
+struct EncodeSlot {
+    EncodeSlot(const ZlingConfig& config, int subblock_num): res(config, subblock_num) {}
+
+    EncodeResource res;
+    std::vector<unsigned char> obuf;
+    std::future<void> done;
+    int ilen;
+    int ret;
+};
+
+struct DecodeSlot {
+    DecodeSlot(const ZlingConfig& config, int subblock_num): res(config, subblock_num) {}
+
+    DecodeResource res;
+    std::vector<unsigned char> ibuf;
+    std::future<void> done;
+    int decpos;
+    int ret;
+};
+
+/* EncodeStream:
+ *  arg res: resource for sequential coding (thread_num <= 1) allocated with config, allocated
+ *           internally if NULL. contexts and the batch codec pass their resources here to reuse them.
+ *  return: -1 if a block failed to encode, 0 otherwise (I/O errors are reported by inputter/outputter).
+ */
+static int EncodeStream(Inputter* inputter, Outputter* outputter, ActionHandler* action_handler, int level,
+                         int thread_num, const ZlingConfig& config, const ZlingDictionary* dictionary,
+                         EncodeResource* res = NULL) {
+    int dict_len = (dictionary != NULL) ? dictionary->GetSize() : 0;
+    int ret = 0;
+
+    if (!config.IsValid()) {
+        throw std::runtime_error("baidu::zling::Encode(): invalid config.");
+    }
+    if (dict_len > config.block_size / 2) {
+        throw std::runtime_error("baidu::zling::Encode(): dictionary too large for block_size.");
+    }
+    outputter->PutChar(kFlagStreamHeader);
+    outputter->PutChar(dictionary != NULL ? kStreamVersion : kStreamVersionNoDictionary);
+    outputter->PutChar(Log2(config.block_size));
+    outputter->PutChar(Log2(config.rolz_size));
+    outputter->PutChar(Log2(config.bucket_size));
+    outputter->PutChar(Log2(config.bucket_hash));
+    if (dictionary != NULL) {
+        outputter->PutUInt32(dictionary->GetId());
+    }
+    CHECK_IO_ERROR(outputter);
+
+    if (thread_num <= 1) {
+        std::unique_ptr<EncodeResource> owned_res(res == NULL ? new EncodeResource(config) : NULL);
+        int ilen;
+
+        if (res == NULL) {
+            res = owned_res.get();
+        }
+        res->SetDictionary(dictionary);
+
+        while (!inputter->IsEnd() && !inputter->IsErr()) {
+            ilen = dict_len + ReadBlock(inputter, res->ibuf + dict_len, config.block_size - dict_len);
+            CHECK_IO_ERROR(inputter);
+
+            if (EncodeBlock(res, ilen, level, outputter, NULL) == -1) {
+                ret = -1;
+                goto EncodeOrDecodeFinished;
+            }
+            if (action_handler) {
+                action_handler->OnProcess(res->ibuf + dict_len, ilen - dict_len);
+            }
+        }
+
+    } else {
+        // blocks are encoded by worker threads, one more slot is kept for reading.
+        // HUFFMAN stages of each block are also passed to the pool.
+        std::vector<std::unique_ptr<EncodeSlot> > slots(thread_num + 1);
+        thread::ZlingThreadPool pool(thread_num);
+        uint64_t nread = 0;
+        uint64_t nwrite = 0;
+
+        for (size_t i = 0; i < slots.size(); i++) {
+            slots[i].reset(new EncodeSlot(config, kPipelineSubBlocks));
+            slots[i]->res.SetDictionary(dictionary);
+        }
+        while (true) {
+            while (nread - nwrite < slots.size() && !inputter->IsEnd() && !inputter->IsErr()) {
+                EncodeSlot* slot = slots[nread++ % slots.size()].get();
+
+                slot->ilen = dict_len + ReadBlock(inputter, slot->res.ibuf + dict_len, config.block_size - dict_len);
+                CHECK_IO_ERROR(inputter);
+
+                slot->obuf.clear();
+                slot->done = pool.Submit([slot, level, &pool]() {
+                    MemoryOutputter block_outputter(&slot->obuf);
+                    slot->ret = EncodeBlock(&slot->res, slot->ilen, level, &block_outputter, &pool);
+                });
+            }
+            if (nwrite == nread) {
+                break;
+            }
+
+            // output blocks in input order
+            EncodeSlot* slot = slots[nwrite++ % slots.size()].get();
+            slot->done.get();
+            if (slot->ret == -1) {
+                ret = -1;
+                goto EncodeOrDecodeFinished;
+            }
+
+            for (size_t ooff = 0; !outputter->IsErr() && ooff < slot->obuf.size(); ) {
+                ooff += outputter->PutData(&slot->obuf[ooff], slot->obuf.size() - ooff);
+                CHECK_IO_ERROR(outputter);
+            }
+            if (action_handler) {
+                action_handler->OnProcess(slot->res.ibuf + dict_len, slot->ilen - dict_len);
+            }
+        }
+    }
+
+EncodeOrDecodeFinished:
+    return ret;
+}
+
+/* DecodeResourceCache: decode resource kept between streams, reallocated (with the same allocation
+ *  policy) for streams with another config.
+ */
+struct DecodeResourceCache {
+    DecodeResourceCache(Allocator* allocator = GetDefaultAllocator(), bool use_arena = false):
+        allocator(allocator),
+        use_arena(use_arena) {}
+
+    /* the old resource is freed before allocating the new one (to keep peak memory down), so res is
+     * empty if the allocation throws, the next Get() allocates again.
+     */
+    DecodeResource* Get(const ZlingConfig& config) {
+        if (!res || !IsSameConfig(res->config, config)) {
+            res.reset();  // free before allocating the new one
+            res.reset(new DecodeResource(config, 1, allocator, use_arena));
+        }
+        return res.get();
+    }
+
+    std::unique_ptr<DecodeResource> res;
+    Allocator* allocator;
+    bool use_arena;
+};
+
+/* StreamHeader: stream config read by ReadStreamHeader().
+ *  legacy streams (without header) use the default config, their first block flag is kept in encflag.
+ */
+struct StreamHeader {
+    ZlingConfig config;
+    int encflag;                        /* -1 if not read */
+    bool legacy;
+    const ZlingDictionary* dictionary;  /* dictionary if used by the stream */
+};
+
+static int ReadStreamHeader(Inputter* inputter, const ZlingDictionary* dictionary, StreamHeader* header) {
+    header->config = ZlingConfig();
+    header->encflag = -1;
+    header->legacy = true;
+    header->dictionary = NULL;
+
+    if (!inputter->IsEnd()) {
+        header->encflag = inputter->GetChar();
+        CHECK_IO_ERROR(inputter);
+
+        if (header->encflag == kFlagStreamHeader) {
+            int version = inputter->GetChar();
+            if (version < 1 || version > kStreamVersion) {
+                throw std::runtime_error("baidu::zling::Decode(): unsupported stream version.");
+            }
+            CHECK_IO_ERROR(inputter);
+
+            if (version >= 3) {
+                int block_bits = inputter->GetChar();
+                int rolz_bits = inputter->GetChar();
+                int bucket_bits = inputter->GetChar();
+                int hash_bits = inputter->GetChar();
+                CHECK_IO_ERROR(inputter);
+
+                if (block_bits > 30 || rolz_bits > 30 || bucket_bits > 30 || hash_bits > 30) {
+                    throw std::runtime_error("baidu::zling::Decode(): unsupported stream config.");
+                }
+                header->config.block_size = 1 << block_bits;
+                header->config.rolz_size = 1 << rolz_bits;
+                header->config.bucket_size = 1 << bucket_bits;
+                header->config.bucket_hash = 1 << hash_bits;
+                if (!header->config.IsValid()) {
+                    throw std::runtime_error("baidu::zling::Decode(): unsupported stream config.");
+                }
+            }
+            if (version >= 6) {
+                uint32_t dictionary_id = inputter->GetUInt32();
+                CHECK_IO_ERROR(inputter);
+
+                if (dictionary == NULL || dictionary->GetId() != dictionary_id) {
+                    throw std::runtime_error("baidu::zling::Decode(): dictionary not matched.");
+                }
+                if (dictionary->GetSize() > size_t(header->config.block_size / 2)) {
+                    throw std::runtime_error("baidu::zling::Decode(): unsupported stream config.");
+                }
+                header->dictionary = dictionary;
+            }
+            header->legacy = false;
+            header->encflag = -1;
+        }
+    }
+    return 0;
+
+EncodeOrDecodeFinished:
+    return -1;
+}
+
+/* DecodeStream: decode blocks following the stream header.
+ *  arg cache: resource for sequential decoding (thread_num <= 1), allocated internally if NULL.
+ *  return: -1 if a block failed to decode, 0 otherwise (I/O errors are reported by inputter/outputter).
+ */
+static int DecodeStream(Inputter* inputter, Outputter* outputter, ActionHandler* action_handler, int thread_num,
+                        const StreamHeader& header, DecodeResourceCache* cache = NULL) {
+    const ZlingConfig& config = header.config;
+    const ZlingDictionary* stream_dictionary = header.dictionary;
+    int dict_len = (stream_dictionary != NULL) ? stream_dictionary->GetSize() : 0;
+    int encflag = header.encflag;
+    bool legacy = header.legacy;
+    int ret = 0;
+
+    // blocks of legacy streams share MTF tables, they can only be decoded sequentially
+    // (with HUFFMAN stages still running in worker threads)
+    if (thread_num <= 1 || legacy) {
+        // owned_res is declared first to outlive the pool, whose workers may still use it
+        std::unique_ptr<DecodeResource> owned_res;
+        std::unique_ptr<thread::ZlingThreadPool> pool(thread_num > 1 ? new thread::ZlingThreadPool(thread_num) : NULL);
+        DecodeResource* res;
+        int decpos;
+        bool first_block = true;
+
+        if (cache == NULL) {
+            owned_res.reset(new DecodeResource(config, thread_num > 1 ? kPipelineSubBlocks : 1));
+            res = owned_res.get();
+        } else {
+            res = cache->Get(config);
+        }
+        res->SetDictionary(stream_dictionary);
+
+        while (encflag != -1 || !inputter->IsEnd()) {
+            if (encflag == -1) {
+                encflag = inputter->GetChar();
+                CHECK_IO_ERROR(inputter);
+            }
+            res->lzdecoder->Reset(!legacy || first_block);
+            first_block = false;
+
+            if (DecodeBlock(res, inputter, encflag, &decpos, pool.get()) == -1) {
+                ret = -1;
+                goto EncodeOrDecodeFinished;
+            }
+            encflag = -1;
+
+            // output
+            for (int ioff = dict_len; !outputter->IsErr() && ioff < decpos; ) {
+                ioff += outputter->PutData(res->ibuf + ioff, decpos - ioff);
+                CHECK_IO_ERROR(outputter);
+            }
+
+            if (action_handler) {
+                action_handler->OnProcess(res->ibuf + dict_len, decpos - dict_len);
+            }
+        }
+
+    } else {
+        // blocks are found by scanning sub-block headers and decoded by worker threads.
+        // HUFFMAN stages of each block are also passed to the pool.
+        std::vector<std::unique_ptr<DecodeSlot> > slots(thread_num + 1);
+        thread::ZlingThreadPool pool(thread_num);
+        uint64_t nread = 0;
+        uint64_t nwrite = 0;
+
+        for (size_t i = 0; i < slots.size(); i++) {
+            slots[i].reset(new DecodeSlot(config, kPipelineSubBlocks));
+            slots[i]->res.SetDictionary(stream_dictionary);
+        }
+        while (true) {
+            while (nread - nwrite < slots.size() && !inputter->IsEnd()) {
+                DecodeSlot* slot = slots[nread++ % slots.size()].get();
+
+                encflag = inputter->GetChar();
+                CHECK_IO_ERROR(inputter);
+                if (ScanBlock(inputter, encflag, config, &slot->ibuf) == -1) {
+                    ret = -1;
+                    goto EncodeOrDecodeFinished;
+                }
+
+                slot->done = pool.Submit([slot, &pool]() {
+                    MemoryInputter block_inputter(slot->ibuf.data(), slot->ibuf.size());
+
+                    slot->res.lzdecoder->Reset();
+                    slot->ret = DecodeBlock(
+                            &slot->res, &block_inputter, block_inputter.GetChar(), &slot->decpos, &pool);
+                });
+            }
+            if (nwrite == nread) {
+                break;
+            }
+
+            // output blocks in stream order
+            DecodeSlot* slot = slots[nwrite++ % slots.size()].get();
+            slot->done.get();
+            if (slot->ret == -1) {
+                ret = -1;
+                goto EncodeOrDecodeFinished;
+            }
+
+            for (int ioff = dict_len; !outputter->IsErr() && ioff < slot->decpos; ) {
+                ioff += outputter->PutData(slot->res.ibuf + ioff, slot->decpos - ioff);
+                CHECK_IO_ERROR(outputter);
+            }
+            if (action_handler) {
+                action_handler->OnProcess(slot->res.ibuf + dict_len, slot->decpos - dict_len);
+            }
+        }
+    }
+
+EncodeOrDecodeFinished:
+    return ret;
+}
+
+static inline bool IsPowerOf2InRange(int x, int min, int max) {
+    return x >= min && x <= max && (x & (x - 1)) == 0;
+}
+
+ZlingConfig::ZlingConfig():
+    block_size(kBlockSizeIn),
+    rolz_size(kBlockSizeRolz),
+    bucket_size(kBucketItemSize),
+    bucket_hash(kBucketItemHash) {
+    return;
+}
+
+bool ZlingConfig::IsValid() const {
+    return IsPowerOf2InRange(block_size,  1 << 16, 1 << 28)
+        && IsPowerOf2InRange(rolz_size,   1 << 12, 1 << 20)
+        && IsPowerOf2InRange(bucket_size, 1 << 8,  kBucketItemSize)
+        && IsPowerOf2InRange(bucket_hash, 1 << 10, 1 << 16);
+}
+
+ZlingDictionary::ZlingDictionary(const unsigned char* data, size_t size): m_impl(NULL) {
+    if (size > kDictionaryMaxSize) {
+        throw std::runtime_error("baidu::zling::ZlingDictionary(): dictionary too large.");
+    }
+    m_impl = new Impl(data, size);
+}
+
+ZlingDictionary::~ZlingDictionary() {
+    delete m_impl;
+}
+
+uint32_t ZlingDictionary::GetId() const {
+    return m_impl->id;
+}
+
+size_t ZlingDictionary::GetSize() const {
+    return m_impl->rolz.data.size();
+}
+
+size_t GetEncodeMemorySize(const ZlingConfig& config, int thread_num, bool pipelined) {
+    size_t size = 0;
+
+    if (thread_num <= 1) {
+        size += EncodeResource::GetMemorySize(config, 1);
+    } else {
+        // slots with compressed output of a block
+        size += (thread_num + 1) * (EncodeResource::GetMemorySize(config, kPipelineSubBlocks)
+                                    + (config.block_size / config.rolz_size + 1)
+                                    * GetBlockSizeHuffman(config.rolz_size));
+    }
+    if (pipelined) {
+        size += 2 * GetPipelineChunks(config.block_size) * GetPipelineChunkSize(config.block_size);
+    }
+    return size;
+}
+
+size_t GetDecodeMemorySize(const ZlingConfig& config, int thread_num, bool pipelined) {
+    size_t size = 0;
+
+    if (thread_num <= 1) {
+        size += DecodeResource::GetMemorySize(config, 1);
+    } else {
+        // slots with scanned compressed input of a block
+        size += (thread_num + 1) * (DecodeResource::GetMemorySize(config, kPipelineSubBlocks)
+                                    + (config.block_size / config.rolz_size + 1)
+                                    * GetBlockSizeHuffman(config.rolz_size));
+    }
+    if (pipelined) {
+        size += 2 * GetPipelineChunks(config.block_size) * GetPipelineChunkSize(config.block_size);
+    }
+    return size;
+}
+
+static int EncodeWithResource(Inputter* inputter, Outputter* outputter, ActionHandler* action_handler, int level,
+                              int thread_num, bool pipelined, const ZlingConfig& config,
+                              const ZlingDictionary* dictionary, EncodeResource* res) {
+    std::unique_ptr<thread::ZlingPipelinedInputter>  pipelined_inputter;
+    std::unique_ptr<thread::ZlingPipelinedOutputter> pipelined_outputter;
+    int ret;
+
+    // the wrapped inputter/outputter belong to the I/O threads from here on, action_handler gets the
+    // pipelined ones
+    if (pipelined) {
+        int chunk_size = GetPipelineChunkSize(config.block_size);
+        int chunk_num = GetPipelineChunks(config.block_size);
+
+        pipelined_inputter.reset(new thread::ZlingPipelinedInputter(inputter, chunk_size, chunk_num));
+        pipelined_outputter.reset(new thread::ZlingPipelinedOutputter(outputter, chunk_size, chunk_num));
+        inputter = pipelined_inputter.get();
+        outputter = pipelined_outputter.get();
+    }
+    if (action_handler) {
+        action_handler->SetInputterOutputter(inputter, outputter, true);
+        action_handler->OnInit();
+    }
+
+    ret = EncodeStream(inputter, outputter, action_handler, level, thread_num, config, dictionary, res);
+    if (pipelined) {
+        pipelined_outputter->Flush();
+    }
+
+    if (action_handler) {
+        action_handler->OnDone();
+    }
+    return (ret == -1 || inputter->IsErr() || outputter->IsErr()) ? -1 : 0;
+}
+
+int Encode(Inputter* inputter, Outputter* outputter, ActionHandler* action_handler, int level, int thread_num,
+           bool pipelined,
+           const ZlingConfig& config,
+           const ZlingDictionary* dictionary) {
+    return EncodeWithResource(inputter, outputter, action_handler, level, thread_num, pipelined, config, dictionary,
+                              NULL);
+}
+
+static int DecodeWithResource(Inputter* inputter, Outputter* outputter, ActionHandler* action_handler, int thread_num,
+                              bool pipelined, const ZlingDictionary* dictionary, DecodeResourceCache* cache) {
+    std::unique_ptr<thread::ZlingPipelinedInputter>  pipelined_inputter;
+    std::unique_ptr<thread::ZlingPipelinedOutputter> pipelined_outputter;
+    StreamHeader header;
+    int ret;
+
+    // the header is read before pipelining, rings are sized by the block size of the stream
+    ret = ReadStreamHeader(inputter, dictionary, &header);
+    if (pipelined) {
+        int chunk_size = GetPipelineChunkSize(header.config.block_size);
+        int chunk_num = GetPipelineChunks(header.config.block_size);
+
+        pipelined_inputter.reset(new thread::ZlingPipelinedInputter(inputter, chunk_size, chunk_num));
+        pipelined_outputter.reset(new thread::ZlingPipelinedOutputter(outputter, chunk_size, chunk_num));
+        inputter = pipelined_inputter.get();
+        outputter = pipelined_outputter.get();
+    }
+    if (action_handler) {
+        action_handler->SetInputterOutputter(inputter, outputter, false);
+        action_handler->OnInit();
+    }
+
+    if (ret != -1) {
+        ret = DecodeStream(inputter, outputter, action_handler, thread_num, header, cache);
+    }
+    if (pipelined) {
+        pipelined_outputter->Flush();
+    }
+
+    if (action_handler) {
+        action_handler->OnDone();
+    }
+    return (ret == -1 || inputter->IsErr() || outputter->IsErr()) ? -1 : 0;
+}
+
+int Decode(Inputter* inputter, Outputter* outputter, ActionHandler* action_handler, int thread_num, bool pipelined,
+           const ZlingDictionary* dictionary) {
+    return DecodeWithResource(inputter, outputter, action_handler, thread_num, pipelined, dictionary, NULL);
+}
+
+/* CheckContextConfig: config of a context constructor, throws before anything is allocated. */
+static const ZlingConfig& CheckContextConfig(const ZlingConfig& config, const char* message) {
+    if (!config.IsValid()) {
+        throw std::runtime_error(message);
+    }
+    return config;
+}
+
+struct ZlingEncoderContext::Impl {
+    Impl(const ZlingConfig& config, Allocator* allocator, bool use_arena): res(config, 1, allocator, use_arena) {}
+
+    EncodeResource res;
+};
+
+ZlingEncoderContext::ZlingEncoderContext(const ZlingConfig& config, Allocator* allocator, bool use_arena):
+    m_impl(new Impl(CheckContextConfig(config, "baidu::zling::ZlingEncoderContext(): invalid config."),
+                    allocator, use_arena)) {
+    return;
+}
+
+ZlingEncoderContext::~ZlingEncoderContext() {
+    delete m_impl;
+}
+
+size_t ZlingEncoderContext::GetMemoryFootprint() const {
+    return sizeof(*this) + m_impl->res.GetMemorySize();
+}
+
+int Encode(ZlingEncoderContext* context, Inputter* inputter, Outputter* outputter, ActionHandler* action_handler,
+           int level, bool pipelined, const ZlingDictionary* dictionary) {
+    return EncodeWithResource(inputter, outputter, action_handler, level, 1, pipelined, context->m_impl->res.config,
+                              dictionary, &context->m_impl->res);
+}
+
+struct ZlingDecoderContext::Impl {
+    Impl(const ZlingConfig& config, Allocator* allocator, bool use_arena): cache(allocator, use_arena) {
+        cache.Get(config);
+    }
+
+    DecodeResourceCache cache;
+};
+
+ZlingDecoderContext::ZlingDecoderContext(const ZlingConfig& config, Allocator* allocator, bool use_arena):
+    m_impl(new Impl(CheckContextConfig(config, "baidu::zling::ZlingDecoderContext(): invalid config."),
+                    allocator, use_arena)) {
+    return;
+}
+
+ZlingDecoderContext::~ZlingDecoderContext() {
+    delete m_impl;
+}
+
+size_t ZlingDecoderContext::GetMemoryFootprint() const {
+    return sizeof(*this) + (m_impl->cache.res ? m_impl->cache.res->GetMemorySize() : 0);
+}
+
+int Decode(ZlingDecoderContext* context, Inputter* inputter, Outputter* outputter, ActionHandler* action_handler,
+           bool pipelined, const ZlingDictionary* dictionary) {
+    return DecodeWithResource(inputter, outputter, action_handler, 1, pipelined, dictionary, &context->m_impl->cache);
+}
+
+struct ZlingBatchCodec::Impl {
+    Impl(int thread_num, const ZlingConfig& config, Allocator* allocator, const ZlingDictionary* dictionary):
+        pool(thread_num),
+        config(config),
+        allocator(allocator),
+        dictionary(dictionary),
+        encode_res(thread_num),
+        decode_res(thread_num) {
+        for (int i = 0; i < thread_num; i++) {
+            decode_res[i].reset(new DecodeResourceCache(allocator));
+        }
+    }
+
+    /* run task(i) for each item in the pool, the first exception is rethrown after all items finished. */
+    void Run(size_t item_num, const std::function<void (size_t)>& task) {
+        std::vector<std::future<void> > futures(item_num);
+        std::exception_ptr err;
+
+        for (size_t i = 0; i < item_num; i++) {
+            futures[i] = pool.Submit(std::bind(task, i));
+        }
+        for (size_t i = 0; i < item_num; i++) {
+            try {
+                futures[i].get();
+            } catch (...) {
+                if (!err) {
+                    err = std::current_exception();
+                }
+            }
+        }
+        if (err) {
+            std::rethrow_exception(err);
+        }
+    }
+
+    thread::ZlingThreadPool pool;
+    ZlingConfig config;
+    Allocator* allocator;
+    const ZlingDictionary* dictionary;
+    std::vector<std::unique_ptr<EncodeResource> > encode_res;  /* indexed by worker, allocated on first use */
+    std::vector<std::unique_ptr<DecodeResourceCache> > decode_res;
+};
+
+ZlingBatchCodec::ZlingBatchCodec(int thread_num, const ZlingConfig& config, Allocator* allocator,
+                                 const ZlingDictionary* dictionary):
+    m_impl(new Impl(std::max(thread_num, 1), config, allocator, dictionary)) {
+    return;
+}
+
+ZlingBatchCodec::~ZlingBatchCodec() {
+    delete m_impl;
+}
+
+int ZlingBatchCodec::Encode(const std::vector<std::vector<unsigned char> >& ibufs,
+                            std::vector<std::vector<unsigned char> >* obufs,
+                            int level) {
+    Impl* impl = m_impl;
+    std::vector<int> rets(ibufs.size(), 0);
+
+    obufs->resize(ibufs.size());
+    impl->Run(ibufs.size(), [&](size_t i) {
+        std::unique_ptr<EncodeResource>& res = impl->encode_res[impl->pool.GetWorkerIndex()];
+        if (!res) {
+            res.reset(new EncodeResource(impl->config, 1, impl->allocator));
+        }
+        MemoryInputter  inputter(ibufs[i].data(), ibufs[i].size());
+        MemoryOutputter outputter(&(*obufs)[i]);
+
+        (*obufs)[i].clear();
+        int ret = EncodeStream(&inputter, &outputter, NULL, level, 1, impl->config, impl->dictionary, res.get());
+        rets[i] = (ret == -1 || inputter.IsErr() || outputter.IsErr()) ? -1 : 0;
+    });
+    return std::count(rets.begin(), rets.end(), -1) > 0 ? -1 : 0;
+}
+
+int ZlingBatchCodec::Decode(const std::vector<std::vector<unsigned char> >& ibufs,
+                            std::vector<std::vector<unsigned char> >* obufs) {
+    Impl* impl = m_impl;
+    std::vector<int> rets(ibufs.size(), 0);
+
+    obufs->resize(ibufs.size());
+    impl->Run(ibufs.size(), [&](size_t i) {
+        DecodeResourceCache* cache = impl->decode_res[impl->pool.GetWorkerIndex()].get();
+        MemoryInputter  inputter(ibufs[i].data(), ibufs[i].size());
+        MemoryOutputter outputter(&(*obufs)[i]);
+
+        (*obufs)[i].clear();
+        StreamHeader header;
+        int ret = ReadStreamHeader(&inputter, impl->dictionary, &header);
+
+        if (ret != -1) {
+            ret = DecodeStream(&inputter, &outputter, NULL, 1, header, cache);
+        }
+        rets[i] = (ret == -1 || inputter.IsErr() || outputter.IsErr()) ? -1 : 0;
+    });
+    return std::count(rets.begin(), rets.end(), -1) > 0 ? -1 : 0;
 }
 
 }  // namespace zling
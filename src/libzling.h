@@ -41,8 +41,194 @@
 namespace baidu {
 namespace zling {
 
-int Encode(Inputter* inputter, Outputter* outputter, ActionHandler* action_handler = NULL, int level = 0);
-int Decode(Inputter* inputter, Outputter* outputter, ActionHandler* action_handler = NULL);
+/* ZlingConfig: stream geometry chosen at encode time, recorded in the stream header so the decoder
+ *  allocates to match. all values must be powers of 2.
+ *  block_size:  bytes of an independent block [64KB, 256MB], larger blocks find more matches.
+ *  rolz_size:   ROLZ symbols of a sub-block [4K, 1M].
+ *  bucket_size: match candidates kept for each context [256, 4096].
+ *  bucket_hash: hash heads for each context [1K, 64K], only used by the encoder.
+ */
+struct ZlingConfig {
+    ZlingConfig();  /* default: 16MB blocks, 256K sub-blocks, 4096 bucket items, 8192 hash heads */
+    bool IsValid() const;
+
+    int block_size;
+    int rolz_size;
+    int bucket_size;
+    int bucket_hash;
+};
+
+/* GetEncodeMemorySize/GetDecodeMemorySize:
+ *  bytes needed by Encode()/Decode() with the given config and arguments (upper bound).
+ */
+size_t GetEncodeMemorySize(const ZlingConfig& config = ZlingConfig(), int thread_num = 1, bool pipelined = false);
+size_t GetDecodeMemorySize(const ZlingConfig& config = ZlingConfig(), int thread_num = 1, bool pipelined = false);
+
+/* ZlingDictionary: a preset dictionary, data expected in the streams (e.g. samples of small messages,
+ *  more common data at the end). each block starts with the state primed by the dictionary, so even
+ *  the first bytes of a block can be matched and small blocks need no HUFFMAN tables of their own.
+ *  the state (MTF tables, word MRU and HUFFMAN tables) is built once by the constructor by coding the
+ *  dictionary, each block copies it and adds dictionary positions to ROLZ buckets.
+ *  streams encoded with a dictionary record its id, and can only be decoded with the same dictionary.
+ *  blocks hold config.block_size - GetSize() bytes of data, the size must be <= config.block_size / 2.
+ *
+ *  a dictionary can be shared by any number of threads, and must outlive the calls taking it.
+ *  GetId(): adler32 of the dictionary data.
+ */
+class ZlingDictionary {
+public:
+    ZlingDictionary(const unsigned char* data, size_t size);
+    ~ZlingDictionary();
+
+    uint32_t GetId() const;
+    size_t GetSize() const;
+
+private:
+    struct Impl;
+    Impl* m_impl;
+
+    friend struct EncodeResource;
+    friend struct DecodeResource;
+
+    ZlingDictionary(const ZlingDictionary&);
+    ZlingDictionary& operator = (const ZlingDictionary&);
+};
+
+/* levels of Encode():
+ *  -1:                   fastest, a single match probe per position and no lazy matching.
+ *  0..4:                 bigger level for better and slower compression.
+ *  5:                    optimal parsing, much slower than 4 (decoding speed is the same).
+ *  kLevelAuto + [0,100]: choose a level of 0..4 for each block by probing its data (byte entropy and
+ *                        a ROLZ trial of a few KB, blocks under 256KB are not probed and get a level
+ *                        in proportion to the weight). the number is the weight (in percent) of
+ *                        compression ratio against speed: kLevelAuto + 0 always uses level 0,
+ *                        kLevelAuto + 100 uses the level with the best ratio whatever it costs.
+ */
+static const int kLevelAuto = 1000;
+
+/* Encode:
+ *  arg thread_num: number of worker threads, each encodes an independent 16MB block, HUFFMAN
+ *                  encoding of sub-blocks runs in other threads (so a single block also benefits).
+ *                  output is identical for any thread_num.
+ *  arg pipelined:  read ahead/write behind in an I/O thread, overlapping I/O with encoding.
+ *                  inputter/outputter are accessed by the I/O thread while encoding.
+ *  arg config:     stream geometry, throws std::runtime_error if invalid.
+ *  arg dictionary: preset dictionary (NULL: without dictionary), throws std::runtime_error if too large.
+ */
+int Encode(Inputter* inputter, Outputter* outputter, ActionHandler* action_handler = NULL, int level = 0,
+           int thread_num = 1,
+           bool pipelined = false,
+           const ZlingConfig& config = ZlingConfig(),
+           const ZlingDictionary* dictionary = NULL);
+/* Decode:
+ *  arg thread_num: number of worker threads, blocks are located by scanning sub-block headers
+ *                  and decoded in parallel (streams written before version 1 are decoded sequentially).
+ *                  HUFFMAN decoding of sub-blocks overlaps with ROLZ decoding of previous ones.
+ *  arg pipelined:  same as Encode().
+ *  arg dictionary: dictionary of the stream, throws std::runtime_error if the stream needs another one
+ *                  (ignored by streams encoded without dictionary).
+ *  the config is read from the stream header.
+ */
+int Decode(Inputter* inputter, Outputter* outputter, ActionHandler* action_handler = NULL, int thread_num = 1,
+           bool pipelined = false,
+           const ZlingDictionary* dictionary = NULL);
+
+/* ZlingEncoderContext/ZlingDecoderContext: buffers and ROLZ state of a sequential encoder/decoder.
+ *  a context is allocated once and reused by any number of Encode()/Decode() calls taking it,
+ *  avoiding the per-call allocation (and page faults) of ~27MB. a context must not be used by
+ *  multiple threads at the same time, create one per thread instead.
+ *
+ *  an encoder context encodes with the config it was created with. a decoder context is created
+ *  for a config and reallocated when decoding a stream with another one (if the reallocation
+ *  fails, Decode() throws and the next call allocates again).
+ *  the constructors throw std::runtime_error if config is invalid, before allocating anything.
+ *
+ *  arg allocator: allocator of all large buffers (e.g. GetHugePageAllocator()), must outlive the context.
+ *  arg use_arena: allocate all large buffers from one contiguous allocation of allocator.
+ *
+ *  GetMemoryFootprint(): bytes allocated by the context.
+ */
+class ZlingEncoderContext {
+public:
+    ZlingEncoderContext(const ZlingConfig& config = ZlingConfig(), Allocator* allocator = GetDefaultAllocator(),
+                        bool use_arena = false);
+    ~ZlingEncoderContext();
+
+    size_t GetMemoryFootprint() const;
+
+private:
+    struct Impl;
+    Impl* m_impl;
+
+    friend int Encode(ZlingEncoderContext* context, Inputter* inputter, Outputter* outputter,
+                      ActionHandler* action_handler, int level, bool pipelined, const ZlingDictionary* dictionary);
+
+    ZlingEncoderContext(const ZlingEncoderContext&);
+    ZlingEncoderContext& operator = (const ZlingEncoderContext&);
+};
+
+class ZlingDecoderContext {
+public:
+    ZlingDecoderContext(const ZlingConfig& config = ZlingConfig(), Allocator* allocator = GetDefaultAllocator(),
+                        bool use_arena = false);
+    ~ZlingDecoderContext();
+
+    size_t GetMemoryFootprint() const;
+
+private:
+    struct Impl;
+    Impl* m_impl;
+
+    friend int Decode(ZlingDecoderContext* context, Inputter* inputter, Outputter* outputter,
+                      ActionHandler* action_handler, bool pipelined, const ZlingDictionary* dictionary);
+
+    ZlingDecoderContext(const ZlingDecoderContext&);
+    ZlingDecoderContext& operator = (const ZlingDecoderContext&);
+};
+
+/* Encode/Decode with a context: same as Encode()/Decode() with thread_num = 1, using the
+ * buffers of context instead of allocating new ones.
+ */
+int Encode(ZlingEncoderContext* context, Inputter* inputter, Outputter* outputter,
+           ActionHandler* action_handler = NULL, int level = 0,
+           bool pipelined = false,
+           const ZlingDictionary* dictionary = NULL);
+int Decode(ZlingDecoderContext* context, Inputter* inputter, Outputter* outputter,
+           ActionHandler* action_handler = NULL,
+           bool pipelined = false,
+           const ZlingDictionary* dictionary = NULL);
+
+/* ZlingBatchCodec: encode/decode many independent buffers on a shared work-stealing thread pool.
+ *  each buffer is coded as a complete stream (same format as Encode()/Decode()), encoder/decoder
+ *  resources are kept per worker thread and reused between items and calls.
+ *
+ *  Encode()/Decode(): obufs is resized to ibufs.size(), obufs[i] is the output of ibufs[i].
+ *                     if an item throws (e.g. corrupted input of Decode()), the exception is
+ *                     rethrown after all other items finished.
+ *
+ *  a ZlingBatchCodec must not be used by multiple threads at the same time.
+ */
+class ZlingBatchCodec {
+public:
+    ZlingBatchCodec(int thread_num,
+                    const ZlingConfig& config = ZlingConfig(),  /* config of Encode() */
+                    Allocator* allocator = GetDefaultAllocator(),
+                    const ZlingDictionary* dictionary = NULL);  /* dictionary of Encode() and Decode() */
+    ~ZlingBatchCodec();
+
+    int Encode(const std::vector<std::vector<unsigned char> >& ibufs,
+               std::vector<std::vector<unsigned char> >* obufs,
+               int level = 0);
+    int Decode(const std::vector<std::vector<unsigned char> >& ibufs,
+               std::vector<std::vector<unsigned char> >* obufs);
+
+private:
+    struct Impl;
+    Impl* m_impl;
+
+    ZlingBatchCodec(const ZlingBatchCodec&);
+    ZlingBatchCodec& operator = (const ZlingBatchCodec&);
+};
 
 }  // namespace zling
 }  // namespace baidu
@@ -0,0 +1,105 @@
+/**
+ * zling:
+ *  light-weight lossless data compression utility.
+ *
+ * Copyright (C) 2012-2013 by Zhang Li <zhangli10 at baidu.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @author zhangli10<zhangli10@baidu.com>
+ * @brief  runtime CPU feature detection for kernel dispatch.
+ */
+#ifndef SRC_LIBZLING_CPU_H
+#define SRC_LIBZLING_CPU_H
+
+#include "libzling_inc.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define LIBZLING_X86_DISPATCH 1  /* x86 kernels are built with target attributes and selected at runtime */
+#include <immintrin.h>
+#endif
+
+namespace baidu {
+namespace zling {
+namespace cpu {
+
+/* ZlingCpuFeatures: features of the running CPU, detected once.
+ *  kernels with several implementations select one at initialization with GetCpuFeatures(),
+ *  so the choice costs nothing in inner loops.
+ */
+struct ZlingCpuFeatures {
+    bool sse2;
+    bool avx2;
+    bool bmi2;
+};
+
+const ZlingCpuFeatures& GetCpuFeatures();
+
+/* LoadUInt64: unaligned little-endian load */
+static inline uint64_t LoadUInt64(const unsigned char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+/* StoreUInt64: unaligned little-endian store */
+static inline void StoreUInt64(unsigned char* p, uint64_t v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    memcpy(p, &v, sizeof(v));
+}
+
+/* Prefetch: hint that ptr will be read soon, never faults */
+static inline void Prefetch(const void* ptr) {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(ptr, 0, 3);
+#else
+    (void)ptr;
+#endif
+}
+
+/* CountTrailingZeros: x must not be 0 */
+static inline int CountTrailingZeros(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while ((x & 1) == 0) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+}  // namespace cpu
+}  // namespace zling
+}  // namespace baidu
+#endif  // SRC_LIBZLING_CPU_H
@@ -40,73 +40,68 @@ namespace huffman {
 
 void ZlingMakeLengthTable(const uint32_t* freq_table, uint32_t* length_table, int max_codes, int max_codelen) {
     std::fill(&length_table[0], &length_table[max_codes], 0);
-    auto scaling = 0;
-
-    struct huffman_node {
-        int id;
-        int weight;
-        huffman_node* child1;
-        huffman_node* child2;
-
-        inline huffman_node(int id, int weight, huffman_node* child1 = NULL, huffman_node* child2 = NULL) {
-            this->id = id;
-            this->weight = weight;
-            this->child1 = child1;
-            this->child2 = child2;
-        }
-
-        inline ~huffman_node() {
-            delete child1;
-            delete child2;
-        }
-
-        struct ptr_weight_gt_comparator {
-            inline bool operator()(const huffman_node* lhs, const huffman_node* rhs) const {
-                return lhs->weight > rhs->weight;
-            }
-        };
-    };
 
-build_huffman:
-    // setup heap of leaf nodes
-    auto nodes = std::vector<huffman_node*>();
+    // package-merge: list[d] holds the 2n-2 lightest items at depth d (leaves and packages of two items
+    //  of list[d + 1]). selecting the first 2n-2 items of list[1] gives the optimal length-limited code,
+    //  where the length of a leaf is the number of lists in which it is selected.
+    uint16_t leaves[kHuffmanMaxCodes];
+    uint64_t weights[2][kHuffmanMaxCodes * 2];
+    uint8_t  is_leaf[kHuffmanMaxCodeLen + 1][kHuffmanMaxCodes * 2];
+    int n = 0;
 
     for (auto i = 0; i < max_codes; i++) {
         if (freq_table[i] > 0) {
-            nodes.push_back(new huffman_node(i, (freq_table[i] + ((1 << scaling) - 1)) >> scaling));
+            leaves[n++] = i;
         }
     }
-    if (nodes.empty()) {
+    if (n <= 2) {
+        for (auto i = 0; i < n; i++) {
+            length_table[leaves[i]] = 1;
+        }
         return;
     }
-    auto nodes_heap = std::priority_queue<
-        huffman_node*,
-        std::vector<huffman_node*>,
-        huffman_node::ptr_weight_gt_comparator>(nodes.begin(), nodes.end());
-
-    // construct huffman tree
-    while (nodes_heap.size() > 1) {
-        auto min1 = nodes_heap.top(); nodes_heap.pop();
-        auto min2 = nodes_heap.top(); nodes_heap.pop();
-        nodes_heap.push(new huffman_node(-1, min1->weight + min2->weight, min1, min2));
+    std::sort(&leaves[0], &leaves[n], [&](auto lhs, auto rhs) {
+        return freq_table[lhs] < freq_table[rhs] || (freq_table[lhs] == freq_table[rhs] && lhs < rhs);
+    });
+
+    // build lists from the deepest level, each list only needs its first 2n-2 items
+    auto list_len = 0;
+    auto list_max = 2 * n - 2;
+
+    for (auto d = max_codelen; d >= 1; d--) {
+        const uint64_t* lower = weights[(d + 1) % 2];
+        uint64_t* current = weights[d % 2];
+        auto npackages = list_len / 2;
+        auto leaf = 0;
+        auto package = 0;
+
+        list_len = 0;
+        while (list_len < list_max && (leaf < n || package < npackages)) {
+            auto package_weight = (package < npackages) ? lower[package * 2] + lower[package * 2 + 1] : 0;
+
+            if (package >= npackages || (leaf < n && freq_table[leaves[leaf]] <= package_weight)) {
+                current[list_len] = freq_table[leaves[leaf++]];
+                is_leaf[d][list_len++] = 1;
+            } else {
+                current[list_len] = package_weight;
+                is_leaf[d][list_len++] = 0;
+                package++;
+            }
+        }
     }
 
-    // extract code length
-    std::function<void (huffman_node*, int)> code_length_extractor = [&](auto node, auto code_length) {
-        if (node->id >= 0) {
-            length_table[node->id] = std::max(code_length, 1);
-        } else {
-            code_length_extractor(node->child1, code_length + 1);
-            code_length_extractor(node->child2, code_length + 1);
+    // walk down selected items: leaves selected in list[d] are the lightest ones
+    auto selected = list_max;
+    for (auto d = 1; d <= max_codelen && selected > 0; d++) {
+        auto nleaves = 0;
+
+        for (auto i = 0; i < selected; i++) {
+            nleaves += is_leaf[d][i];
+        }
+        for (auto i = 0; i < nleaves; i++) {
+            length_table[leaves[i]] += 1;
         }
-    };
-    code_length_extractor(nodes_heap.top(), 0);
-    delete nodes_heap.top();
-
-    // need rescaling?
-    if (*std::max_element(&length_table[0], &length_table[max_codes]) > max_codelen) {
-        scaling++;
-        goto build_huffman;
+        selected = (selected - nleaves) * 2;
     }
     return;
 }
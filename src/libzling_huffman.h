@@ -41,13 +41,16 @@ namespace baidu {
 namespace zling {
 namespace huffman {
 
-// ZlingMakeDecodeTable: build canonical length table from frequency table,
-//  both tables should have kHuffmanSymbols elements.
+static const int kHuffmanMaxCodes   = 1024;
+static const int kHuffmanMaxCodeLen = 15;
+
+// ZlingMakeLengthTable: build optimal length-limited canonical length table from frequency table
+//  (package-merge), both tables should have max_codes elements. no heap allocation.
 //
 //  arg freq_table   frequency_table
 //  arg length_table length_table
-//  arg max_codes    max codes       -- codes shoude be even
-//  arg max_codelen  max code length -- codelen should be < 16
+//  arg max_codes    max codes       -- codes shoude be even, <= kHuffmanMaxCodes
+//  arg max_codelen  max code length -- codelen should be <= kHuffmanMaxCodeLen, (1 << codelen) >= max_codes
 void ZlingMakeLengthTable(const uint32_t* freq_table, uint32_t* length_table, int max_codes, int max_codelen);
 
 // ZlingMakeEncodeTable: build encode table from canonical length table.
@@ -36,9 +36,11 @@
 #define SRC_LIBZLING_INC_H
 
 #include <algorithm>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
 #include <stdexcept>
 #include <queue>
 #include <vector>
@@ -33,6 +33,7 @@
  * @brief  manipulate ROLZ (reduced offset Lempel-Ziv) compression.
  */
 #include "libzling_lz.h"
+#include "libzling_cpu.h"
 #include "libzling_debug.h"
 #include <iostream>
 
@@ -48,63 +49,151 @@ static const unsigned char mtfnext[] = {
 };
 
 #ifdef __GNUC__
-static inline uint32_t RollingAdd(uint32_t x, uint32_t y) __attribute__((pure));
-static inline uint32_t RollingSub(uint32_t x, uint32_t y) __attribute__((pure));
+static inline uint32_t RollingAdd(uint32_t x, uint32_t y, uint32_t mask) __attribute__((pure));
+static inline uint32_t RollingSub(uint32_t x, uint32_t y, uint32_t mask) __attribute__((pure));
 #endif
 
 static inline uint32_t HashContext(unsigned char* ptr) {
     return (*reinterpret_cast<uint32_t*>(ptr) + ptr[2] * 137 + ptr[3] * 13337);
 }
 
-static inline uint32_t RollingAdd(uint32_t x, uint32_t y) {
-    return (x + y) & (kBucketItemSize - 1);
+/* encoder prefetch distances (in positions ahead of the parser) of each pipeline stage. */
+static const int kPrefetchHashDistance = 8;
+static const int kPrefetchChainDistance = 4;
+static const int kPrefetchCandidateDistance = 2;
+static const int kHashRingSize = 16;  /* hashes of positions up to kPrefetchHashDistance ahead, by position */
+
+/* level -1: after (1 << kFastSkipShift) misses in a row, probe every 2nd position, then every 3rd... */
+static const int kFastSkipShift = 4;
+
+static inline uint32_t RollingAdd(uint32_t x, uint32_t y, uint32_t mask) {
+    return (x + y) & mask;
 }
-static inline uint32_t RollingSub(uint32_t x, uint32_t y) {
-    return (x - y) & (kBucketItemSize - 1);
+static inline uint32_t RollingSub(uint32_t x, uint32_t y, uint32_t mask) {
+    return (x - y) & mask;
 }
 
-static inline int GetCommonLength(unsigned char* buf1, unsigned char* buf2, int maxlen) {
-    unsigned char* p1 = buf1;
-    unsigned char* p2 = buf2;
 
-    if (*reinterpret_cast<volatile uint32_t*>(p1) != *reinterpret_cast<volatile uint32_t*>(p2)) {
-        return 0;
+/* common-length kernels:
+ *  compare buf1 and buf2 and return the length of their common prefix, clamped to maxlen.
+ *  kernels may read up to 16 bytes past maxlen, callers keep that range inside the block sentinel.
+ */
+typedef int (*CommonLengthKernel)(const unsigned char* buf1, const unsigned char* buf2, int maxlen);
+
+static int GetCommonLengthScalar(const unsigned char* buf1, const unsigned char* buf2, int maxlen) {
+    int len = 0;
+
+    while (len < maxlen) {
+        uint64_t diff = cpu::LoadUInt64(buf1 + len) ^ cpu::LoadUInt64(buf2 + len);
+        if (diff != 0) {
+            len += cpu::CountTrailingZeros(diff) / 8;
+            break;
+        }
+        len += 8;
+    }
+    return std::min(len, maxlen);
+}
+
+#if LIBZLING_X86_DISPATCH
+__attribute__((target("sse2")))
+static int GetCommonLengthSSE2(const unsigned char* buf1, const unsigned char* buf2, int maxlen) {
+    int len = 0;
+
+    while (len < maxlen) {
+        __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf1 + len));
+        __m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf2 + len));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x1, x2)) ^ 0xffff;
+        if (mask != 0) {
+            len += __builtin_ctz(mask);
+            break;
+        }
+        len += 16;
+    }
+    return std::min(len, maxlen);
+}
+
+__attribute__((target("avx2")))
+static int GetCommonLengthAVX2(const unsigned char* buf1, const unsigned char* buf2, int maxlen) {
+    int len = 0;
+
+    while (len + 16 < maxlen) {  // keep the over-read within 16 bytes
+        __m256i y1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf1 + len));
+        __m256i y2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf2 + len));
+        uint32_t mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(y1, y2)));
+        if (mask != 0) {
+            return std::min<int>(len + __builtin_ctz(mask), maxlen);
+        }
+        len += 32;
+    }
+    if (len < maxlen) {
+        __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf1 + len));
+        __m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf2 + len));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x1, x2)) ^ 0xffff;
+        len += (mask != 0) ? __builtin_ctz(mask) : 16;
     }
-    while (maxlen >= 4 && *reinterpret_cast<volatile uint32_t*>(p1) == *reinterpret_cast<volatile uint32_t*>(p2)) {
-        p1 += 4;
-        p2 += 4;
-        maxlen -= 4;
+    return std::min(len, maxlen);
+}
+#endif
+
+static CommonLengthKernel SelectCommonLengthKernel() {
+#if LIBZLING_X86_DISPATCH
+    if (cpu::GetCpuFeatures().avx2) {
+        return GetCommonLengthAVX2;
     }
-    if (maxlen >= 2 && *reinterpret_cast<volatile uint16_t*>(p1) == *reinterpret_cast<volatile uint16_t*>(p2)) {
-        p1 += 2;
-        p2 += 2;
-        maxlen -= 2;
+    if (cpu::GetCpuFeatures().sse2) {
+        return GetCommonLengthSSE2;
     }
-    if (maxlen >= 1 && *reinterpret_cast<volatile uint8_t*>(p1) == *reinterpret_cast<volatile uint8_t*>(p2)) {
-        p1 += 1;
-        p2 += 1;
-        maxlen -= 1;
+#endif
+    return GetCommonLengthScalar;
+}
+
+static const CommonLengthKernel GetCommonLengthKernel = SelectCommonLengthKernel();
+
+static inline int GetCommonLength(const unsigned char* buf1, const unsigned char* buf2, int maxlen) {
+    // most candidates mismatch within the first 8 bytes, handle them without the indirect call
+    uint64_t diff = cpu::LoadUInt64(buf1) ^ cpu::LoadUInt64(buf2);
+    if (diff != 0) {
+        return std::min(cpu::CountTrailingZeros(diff) / 8, maxlen);
     }
-    return p1 - buf1;
+    return (maxlen > 8) ? 8 + GetCommonLengthKernel(buf1 + 8, buf2 + 8, maxlen - 8) : maxlen;
 }
 
-static inline void IncrementalCopyFastPath(unsigned char* src, unsigned char* dst, int len) {
-    while (dst - src < 4) {
-        *reinterpret_cast<volatile uint32_t*>(dst) = *reinterpret_cast<volatile uint32_t*>(src);
+/* Copy16: copy 16 bytes with a single unaligned load/store pair.
+ *  the load completes before the store, so src and dst may overlap.
+ */
+static inline void Copy16(const unsigned char* src, unsigned char* dst) {
+    unsigned char chunk[16];
+    memcpy(chunk, src, sizeof(chunk));
+    memcpy(dst, chunk, sizeof(chunk));
+}
+
+/* IncrementalCopyFastPath: LZ77-style copy of len bytes from src to dst (src < dst).
+ *  writes up to 15 bytes past dst + len, which is covered by the block sentinel.
+ */
+static inline void IncrementalCopyFastPath(const unsigned char* src, unsigned char* dst, int len) {
+    // short distance: each store makes the repeated pattern longer, until it spans 16 bytes
+    while (dst - src < 16 && len > 0) {
+        Copy16(src, dst);
         len -= dst - src;
         dst += dst - src;
     }
     while (len > 0) {
-        *reinterpret_cast<volatile uint32_t*>(dst) = *reinterpret_cast<volatile uint32_t*>(src);
-        len -= 4;
-        dst += 4;
-        src += 4;
+        Copy16(src, dst);
+        len -= 16;
+        dst += 16;
+        src += 16;
     }
     return;
 }
 
 ZlingMTFEncoder::ZlingMTFEncoder() {
-    memcpy(m_table, mtfinit, sizeof(m_table));
+    Reset();
+}
+void ZlingMTFEncoder::Reset() {
+    Reset(mtfinit);
+}
+void ZlingMTFEncoder::Reset(const unsigned char* table) {
+    memcpy(m_table, table, sizeof(m_table));
     for (int i = 0; i < 256; i++) {
         m_index[m_table[i]] = i;
     }
@@ -117,7 +206,13 @@ unsigned char ZlingMTFEncoder::Encode(unsigned char c) {
 }
 
 ZlingMTFDecoder::ZlingMTFDecoder() {
-    memcpy(m_table, mtfinit, sizeof(m_table));
+    Reset();
+}
+void ZlingMTFDecoder::Reset() {
+    Reset(mtfinit);
+}
+void ZlingMTFDecoder::Reset(const unsigned char* table) {
+    memcpy(m_table, table, sizeof(m_table));
 }
 unsigned char ZlingMTFDecoder::Decode(unsigned char i) {
     unsigned char c = m_table[i];
@@ -125,6 +220,62 @@ unsigned char ZlingMTFDecoder::Decode(unsigned char i) {
     return c;
 }
 
+ZlingRolzDictionary::ZlingRolzDictionary(const unsigned char* buf, int len): data(buf, buf + len) {
+    memset(mtf_primed, 0, sizeof(mtf_primed));
+    memset(word_mru, 0, sizeof(word_mru));
+
+    // the decoder updates word MRU like this after matches
+    for (int pos = 2; pos < len; pos++) {
+        if (word_mru[buf[pos - 2]][0] != (buf[pos - 1] << 8 | buf[pos])) {
+            word_mru[buf[pos - 2]][1] = word_mru[buf[pos - 2]][0];
+            word_mru[buf[pos - 2]][0] = buf[pos - 1] << 8 | buf[pos];
+        }
+    }
+}
+
+ZlingRolzEncoder::ZlingRolzEncoder(int bucket_size, int bucket_hash, int offset_bits, Allocator* allocator):
+    m_epoch(0),
+    m_allocator(allocator),
+    m_bucket_data(NULL),
+    m_bucket_stride(bucket_size * (sizeof(uint32_t) + sizeof(uint16_t)) + bucket_hash * sizeof(uint16_t)),
+    m_bucket_mask(bucket_size - 1),
+    m_hash_mask(bucket_hash - 1),
+    m_hash_bits(Log2(bucket_hash)),
+    m_offset_bits(offset_bits) {
+
+    // all arrays of a context are contiguous: a chain walk stays within one region of
+    // bucket_stride bytes instead of touching three arrays spread over the whole table.
+    m_bucket_data = static_cast<unsigned char*>(allocator->Allocate(256 * m_bucket_stride));
+
+    for (int context = 0; context < 256; context++) {
+        unsigned char* data = m_bucket_data + context * m_bucket_stride;
+
+        m_buckets[context].offset = reinterpret_cast<uint32_t*>(data);
+        m_buckets[context].suffix = reinterpret_cast<uint16_t*>(data + bucket_size * sizeof(uint32_t));
+        m_buckets[context].hash = reinterpret_cast<uint16_t*>(data + bucket_size * (sizeof(uint32_t) + sizeof(uint16_t)));
+    }
+    memset(m_context_epoch, 0, sizeof(m_context_epoch));
+    // flat prices until SetPrices()
+    std::fill(m_prices.symbol, m_prices.symbol + sizeof(m_prices.symbol) / sizeof(m_prices.symbol[0]), 8);
+    std::fill(m_prices.matchidx, m_prices.matchidx + sizeof(m_prices.matchidx) / sizeof(m_prices.matchidx[0]), 16);
+    Reset();
+}
+
+ZlingRolzEncoder::~ZlingRolzEncoder() {
+    Free();
+}
+
+void ZlingRolzEncoder::Free() {
+    if (m_bucket_data != NULL) {
+        m_allocator->Free(m_bucket_data, 256 * m_bucket_stride);
+    }
+}
+
+size_t ZlingRolzEncoder::GetMemorySize(int bucket_size, int bucket_hash) {
+    return sizeof(ZlingRolzEncoder) + 256 * (bucket_size * (sizeof(uint16_t) + sizeof(uint32_t))
+                                             + bucket_hash * sizeof(uint16_t));
+}
+
 int ZlingRolzEncoder::Encode(int level, unsigned char* ibuf, uint16_t* obuf, int ilen, int olen, int* encpos) {
     switch (level) {
         case 0: return EncodeImpl<2,  1, 0>(ibuf, obuf, ilen, olen, encpos);
@@ -132,6 +283,8 @@ int ZlingRolzEncoder::Encode(int level, unsigned char* ibuf, uint16_t* obuf, int
         case 2: return EncodeImpl<6,  2, 0>(ibuf, obuf, ilen, olen, encpos);
         case 3: return EncodeImpl<8,  3, 1>(ibuf, obuf, ilen, olen, encpos);
         case 4: return EncodeImpl<16, 4, 2>(ibuf, obuf, ilen, olen, encpos);
+        case 5: return EncodeOptimal(ibuf, obuf, ilen, olen, encpos);
+        case -1: return EncodeFast(ibuf, obuf, ilen, olen, encpos);
     }
     return -1;
 }
@@ -144,7 +297,11 @@ template<int kMatchDepth, int kLazyMatch1Depth, int kLazyMatch2Depth> int ZlingR
         int* encpos) {
     int ipos = encpos[0];
     int opos = 0;
-    uint16_t word_mru[256][2] = {};
+    uint16_t word_mru[256][2];
+    uint32_t hash_ring[kHashRingSize];
+    int hash_end = ipos;  /* positions below hash_end (and not skipped by matches) are in hash_ring */
+
+    memcpy(word_mru, m_word_mru, sizeof(word_mru));
 
     // first byte
     if (ipos == 0 && opos < olen && ipos < ilen) obuf[opos++] = ibuf[ipos++];
@@ -156,7 +313,18 @@ template<int kMatchDepth, int kLazyMatch1Depth, int kLazyMatch2Depth> int ZlingR
 
         // encode as match
         if (ipos + kMatchMaxLen + 16 < ilen) {  // avoid overflow
-            if (MatchAndUpdate<kMatchDepth, kLazyMatch1Depth, kLazyMatch2Depth>(ibuf, ipos, &match_idx, &match_len)) {
+            // each position is hashed once when it comes within the prefetch distance
+            for (hash_end = std::max(hash_end, ipos); hash_end <= ipos + kPrefetchHashDistance; hash_end++) {
+                hash_ring[hash_end % kHashRingSize] = HashContext(ibuf + hash_end);
+                PrefetchHash(ibuf, hash_end, hash_ring[hash_end % kHashRingSize]);
+            }
+            PrefetchChain(ibuf, ipos + kPrefetchChainDistance,
+                          hash_ring[(ipos + kPrefetchChainDistance) % kHashRingSize]);
+            PrefetchCandidate(ibuf, ipos + kPrefetchCandidateDistance,
+                              hash_ring[(ipos + kPrefetchCandidateDistance) % kHashRingSize]);
+
+            if (MatchAndUpdate<kMatchDepth, kLazyMatch1Depth, kLazyMatch2Depth>(
+                        ibuf, ipos, hash_ring, &match_idx, &match_len)) {
                 obuf[opos++] = 258 + match_len - kMatchMinLen;
                 obuf[opos++] = match_idx;
                 ipos += match_len;
@@ -185,7 +353,7 @@ template<int kMatchDepth, int kLazyMatch1Depth, int kLazyMatch2Depth> int ZlingR
         }
 
         // encode as literal
-        obuf[opos++] = m_mtf[ibuf[ipos - 1]].Encode(ibuf[ipos]);
+        obuf[opos++] = GetMTF(ibuf[ipos - 1])->Encode(ibuf[ipos]);
         ipos++;
         word_mru[ibuf[ipos - 3]][1] = word_mru[ibuf[ipos - 3]][0];
         word_mru[ibuf[ipos - 3]][0] = ibuf[ipos - 2] << 8 | ibuf[ipos - 1];
@@ -194,39 +362,502 @@ template<int kMatchDepth, int kLazyMatch1Depth, int kLazyMatch2Depth> int ZlingR
     return opos;
 }
 
+/* EncodeFast: level -1.
+ *  one hash probe per position, no chaining, lazy matching or words. after a run of misses,
+ *  positions are probed more and more sparsely. positions not probed are still added to buckets
+ *  (as the decoder adds every literal) but without hashing, so they are reached by no hash head
+ *  and only their offsets keep match indexes in sync.
+ */
+int ZlingRolzEncoder::EncodeFast(unsigned char* ibuf, uint16_t* obuf, int ilen, int olen, int* encpos) {
+    int ipos = encpos[0];
+    int opos = 0;
+    int misses = 0;
+    int probe = ipos;
+
+    // first byte
+    if (ipos == 0 && opos < olen && ipos < ilen) obuf[opos++] = ibuf[ipos++];
+    if (ipos == 1 && opos < olen && ipos < ilen) obuf[opos++] = ibuf[ipos++];
+
+    while (opos + 1 < olen && ipos < ilen) {
+        if (ipos + kMatchMaxLen + 16 < ilen) {  // avoid overflow
+            ZlingEncodeBucket* bucket = GetBucket(ibuf[ipos - 1]);
+
+            if (ipos >= probe) {
+                PrefetchHash(ibuf, ipos + kPrefetchHashDistance, HashContext(ibuf + ipos + kPrefetchHashDistance));
+
+                uint32_t hash = HashContext(ibuf + ipos);
+                uint32_t hash_check   = (hash >> m_hash_bits) & ~(-1u << (32 - m_offset_bits));
+                uint32_t hash_context = hash & m_hash_mask;
+                int node = bucket->hash[hash_context];
+
+                bucket->head = RollingAdd(bucket->head, 1, m_bucket_mask);
+                bucket->filled++;
+                bucket->suffix[bucket->head] = node;
+                bucket->offset[bucket->head] = ipos | hash_check << m_offset_bits;
+                bucket->hash[hash_context] = bucket->head;
+
+                if (node != 65535 && node != bucket->head && (bucket->offset[node] >> m_offset_bits) == hash_check) {
+                    int match_len = GetCommonLength(ibuf + ipos,
+                                                    ibuf + (bucket->offset[node] & ~(-1u << m_offset_bits)),
+                                                    kMatchMaxLen);
+                    if (match_len >= kMatchMinLen) {
+                        obuf[opos++] = 258 + match_len - kMatchMinLen;
+                        obuf[opos++] = RollingSub(bucket->head, node, m_bucket_mask);
+                        ipos += match_len;
+                        probe = ipos;
+                        misses = 0;
+                        continue;
+                    }
+                }
+                probe = ipos + 1 + (++misses >> kFastSkipShift);
+            } else {
+                bucket->head = RollingAdd(bucket->head, 1, m_bucket_mask);
+                bucket->filled++;
+                bucket->offset[bucket->head] = ipos;
+            }
+        }
+
+        // encode as literal
+        obuf[opos++] = GetMTF(ibuf[ipos - 1])->Encode(ibuf[ipos]);
+        ipos++;
+    }
+    encpos[0] = ipos;
+    return opos;
+}
+
+void ZlingRolzEncoder::EncodeStored(unsigned char* ibuf, int ilen, int len, int* encpos) {
+    int ipos = std::max(encpos[0], 2);
+    int iend = std::min(encpos[0] + len, ilen - kMatchMaxLen - 16);  // no matching after iend, like EncodeImpl
+
+    for (; ipos < iend; ipos++) {
+        Update(ibuf, ipos);
+    }
+    encpos[0] += len;
+    return;
+}
+
+void ZlingRolzEncoder::SetPrices(const ZlingRolzPrices& prices) {
+    m_prices = prices;
+    return;
+}
+
+inline ZlingRolzEncoder::ZlingEncodeBucket* ZlingRolzEncoder::Update(unsigned char* buf, int pos) {
+    uint32_t hash = HashContext(buf + pos);
+    uint32_t hash_check   = (hash >> m_hash_bits) & ~(-1u << (32 - m_offset_bits));
+    uint32_t hash_context = hash & m_hash_mask;
+    ZlingEncodeBucket* bucket = GetBucket(buf[pos - 1]);
+
+    bucket->head = RollingAdd(bucket->head, 1, m_bucket_mask);
+    bucket->filled++;
+    bucket->suffix[bucket->head] = bucket->hash[hash_context];
+    bucket->offset[bucket->head] = pos | hash_check << m_offset_bits;
+    bucket->hash[hash_context] = bucket->head;
+    return bucket;
+}
+
+/* EncodeOptimal: level 5.
+ *  input is parsed in windows (ParseOptimal) with MTF tables and word_mru of the window start, then
+ *  the chosen path is encoded with the real states. ParseOptimal adds every window position to
+ *  buckets, but only step positions are added when encoding, so a match may refer to a node which
+ *  is not added yet (or still holds the same position left from an earlier block): it is replaced
+ *  by the longest match found in buckets (up to the parsed length), and positions left by a
+ *  shorter match are matched up to the next step of the path.
+ *  words no longer in word_mru fall back to literals.
+ */
+int ZlingRolzEncoder::EncodeOptimal(unsigned char* ibuf, uint16_t* obuf, int ilen, int olen, int* encpos) {
+    int ipos = encpos[0];
+    int opos = 0;
+    uint16_t word_mru[256][2];
+
+    memcpy(word_mru, m_word_mru, sizeof(word_mru));
+
+    // first byte
+    if (ipos == 0 && opos < olen && ipos < ilen) obuf[opos++] = ibuf[ipos++];
+    if (ipos == 1 && opos < olen && ipos < ilen) obuf[opos++] = ibuf[ipos++];
+
+    while (opos + 1 < olen && ipos < ilen) {
+
+        // encode a parsed window
+        if (ipos + kMatchMaxLen + 16 < ilen) {  // avoid overflow
+            int wpos = ipos;
+            int wend = ipos + m_optimal_path[ParseOptimal(ibuf, ipos, ilen - kMatchMaxLen - 16, word_mru)];
+            int step = 0;
+
+            while (opos + 1 < olen && ipos < wend) {
+                while (wpos + m_optimal_path[step] < ipos) {  // skipped by shortened matches
+                    step++;
+                }
+                const ZlingOptimalNode* node = (wpos + m_optimal_path[step] == ipos)
+                    ? &m_optimal[m_optimal_path[step + 1]]
+                    : NULL;
+                ZlingEncodeBucket* bucket = Update(ibuf, ipos);
+
+                if (node == NULL || node->len >= kMatchMinLen) {
+                    int match_node = (node != NULL) ? node->node : 0;
+                    int match_len = (node != NULL) ? node->len : 0;
+
+                    // off the path (after a shortened match): a match up to the next step
+                    // on the path: the parsed node only if it is added (in this epoch) with the parsed position
+                    if (node == NULL) {
+                        match_len = MatchReplace(ibuf, ipos, bucket, wpos + m_optimal_path[step] - ipos, &match_node);
+                    } else if ((bucket->offset[match_node] & ~(-1u << m_offset_bits)) != node->offset
+                            || match_node == bucket->head
+                            || RollingSub(bucket->head, match_node, m_bucket_mask) >= bucket->filled) {
+                        match_len = MatchReplace(ibuf, ipos, bucket, node->len, &match_node);
+                    }
+                    if (match_len >= kMatchMinLen) {
+                        obuf[opos++] = 258 + match_len - kMatchMinLen;
+                        obuf[opos++] = RollingSub(bucket->head, match_node, m_bucket_mask);
+                        ipos += match_len;
+                        if (word_mru[ibuf[ipos - 3]][0] != (ibuf[ipos - 2] << 8 | ibuf[ipos - 1])) {
+                            word_mru[ibuf[ipos - 3]][1] = word_mru[ibuf[ipos - 3]][0];
+                            word_mru[ibuf[ipos - 3]][0] = ibuf[ipos - 2] << 8 | ibuf[ipos - 1];
+                        }
+                        continue;
+                    }
+                }
+                if (node != NULL && node->len == 2) {
+                    if (word_mru[ibuf[ipos - 1]][0] == (ibuf[ipos] << 8 | ibuf[ipos + 1])) {
+                        obuf[opos++] = 256;
+                        ipos += 2;
+                        continue;
+                    }
+                    if (word_mru[ibuf[ipos - 1]][1] == (ibuf[ipos] << 8 | ibuf[ipos + 1])) {
+                        obuf[opos++] = 257;
+                        ipos += 2;
+                        word_mru[ibuf[ipos - 3]][1] = word_mru[ibuf[ipos - 3]][0];
+                        word_mru[ibuf[ipos - 3]][0] = ibuf[ipos - 2] << 8 | ibuf[ipos - 1];
+                        continue;
+                    }
+                }
+                obuf[opos++] = GetMTF(ibuf[ipos - 1])->Encode(ibuf[ipos]);
+                ipos++;
+                word_mru[ibuf[ipos - 3]][1] = word_mru[ibuf[ipos - 3]][0];
+                word_mru[ibuf[ipos - 3]][0] = ibuf[ipos - 2] << 8 | ibuf[ipos - 1];
+            }
+            continue;
+        }
+
+        // encode as word
+        if (ipos + 1 < ilen) {
+            if (word_mru[ibuf[ipos - 1]][0] == (ibuf[ipos] << 8 | ibuf[ipos + 1])) {
+                obuf[opos++] = 256;
+                ipos += 2;
+                continue;
+            }
+            if (word_mru[ibuf[ipos - 1]][1] == (ibuf[ipos] << 8 | ibuf[ipos + 1])) {
+                obuf[opos++] = 257;
+                ipos += 2;
+                word_mru[ibuf[ipos - 3]][1] = word_mru[ibuf[ipos - 3]][0];
+                word_mru[ibuf[ipos - 3]][0] = ibuf[ipos - 2] << 8 | ibuf[ipos - 1];
+                continue;
+            }
+        }
+
+        // encode as literal
+        obuf[opos++] = GetMTF(ibuf[ipos - 1])->Encode(ibuf[ipos]);
+        ipos++;
+        word_mru[ibuf[ipos - 3]][1] = word_mru[ibuf[ipos - 3]][0];
+        word_mru[ibuf[ipos - 3]][0] = ibuf[ipos - 2] << 8 | ibuf[ipos - 1];
+    }
+    encpos[0] = ipos;
+    return opos;
+}
+
+/* MatchReplace: longest match (up to maxlen) of buf[pos..) in bucket, pos is already added.
+ *  ret: match length, match_node is set if >= kMatchMinLen
+ */
+int ZlingRolzEncoder::MatchReplace(unsigned char* buf, int pos, ZlingEncodeBucket* bucket, int maxlen, int* match_node) {
+    uint32_t hash_check = (HashContext(buf + pos) >> m_hash_bits) & ~(-1u << (32 - m_offset_bits));
+    int node = bucket->suffix[bucket->head];
+    int len = kMatchMinLen - 1;
+
+    for (int depth = 0; node != 65535 && node != bucket->head && depth < kOptimalDepth; depth++) {
+        uint32_t offset = bucket->offset[node] & ~(-1u << m_offset_bits);
+
+        if ((bucket->offset[node] >> m_offset_bits) == hash_check) {
+            int common_len = GetCommonLength(buf + pos, buf + offset, maxlen);
+
+            if (common_len > len) {
+                match_node[0] = node;
+                len = common_len;
+                if (len == maxlen) {
+                    break;
+                }
+            }
+        }
+        node = bucket->suffix[node];
+
+        // end chaining?
+        if (node == 65535 || offset <= (bucket->offset[node] & ~(-1u << m_offset_bits))) {
+            break;
+        }
+    }
+    return len;
+}
+
+/* ParseOptimal: find the cheapest path over buf[pos..) with m_prices, up to kOptimalWindow
+ *  positions (matches are not started at or after end).
+ *  window positions are added to buckets while parsing, so that matches of recent data are found
+ *  (with a bit larger match indexes than encoding), and removed before returning.
+ *  ret: number of steps, m_optimal_path[0..ret] are the step positions (relative to pos) followed
+ *       by the window end, the step starting at m_optimal_path[i] is m_optimal[m_optimal_path[i + 1]].
+ */
+int ZlingRolzEncoder::ParseOptimal(unsigned char* buf, int pos, int end, uint16_t word_mru[256][2]) {
+    int wlen = std::min(end - pos, kOptimalWindow);
+    int wend = wlen;
+    int updates = 0;
+    int steps = 0;
+
+    uint16_t mru[256][2];
+
+    for (int i = 0; i <= wlen + kMatchMaxLen; i++) {
+        m_optimal[i].price = (i == 0) ? 0 : uint32_t(-1);
+    }
+    memcpy(mru, word_mru, sizeof(mru));
+
+    // positions after wlen only finish matches crossing it
+    for (int i = 0; i < wend; i++) {
+        unsigned char* ptr = buf + pos + i;
+        unsigned char context = ptr[-1];
+        uint32_t price = m_optimal[i].price;
+        ZlingOptimalNode* next;
+        int match_len[kOptimalDepth];
+        int match_node[kOptimalDepth];
+        int matches = 0;
+        int maxlen = kMatchMinLen - 1;
+
+        // words are looked up as if every window position is a step end
+        if (i > 0 && mru[ptr[-3]][0] != (ptr[-2] << 8 | ptr[-1])) {
+            mru[ptr[-3]][1] = mru[ptr[-3]][0];
+            mru[ptr[-3]][0] = ptr[-2] << 8 | ptr[-1];
+        }
+
+        if (pos + i < end) {
+            uint32_t hash = HashContext(ptr);
+            uint32_t hash_check   = (hash >> m_hash_bits) & ~(-1u << (32 - m_offset_bits));
+            uint32_t hash_context = hash & m_hash_mask;
+            ZlingEncodeBucket* bucket = GetBucket(context);
+            ZlingOptimalUndo* undo = &m_optimal_undo[updates++];
+            int node = bucket->hash[hash_context];
+
+            // add position, with overwritten entries saved
+            bucket->head = RollingAdd(bucket->head, 1, m_bucket_mask);
+            bucket->filled++;
+            undo->offset = bucket->offset[bucket->head];
+            undo->suffix = bucket->suffix[bucket->head];
+            undo->hash = bucket->hash[hash_context];
+            undo->hash_context = hash_context;
+            undo->context = context;
+            bucket->suffix[bucket->head] = bucket->hash[hash_context];
+            bucket->offset[bucket->head] = (pos + i) | hash_check << m_offset_bits;
+            bucket->hash[hash_context] = bucket->head;
+
+            // find matches of increasing length
+            for (int depth = 0; node != 65535 && node != bucket->head && depth < kOptimalDepth; depth++) {
+                uint32_t offset = bucket->offset[node] & ~(-1u << m_offset_bits);
+                uint32_t check = bucket->offset[node] >> m_offset_bits;
+
+                if (check == hash_check && ptr[maxlen] == buf[offset + maxlen]) {
+                    int len = GetCommonLength(ptr, buf + offset, kMatchMaxLen);
+
+                    if (len > maxlen) {
+                        match_len[matches] = maxlen = len;
+                        match_node[matches] = node;
+                        matches++;
+                        if (maxlen == kMatchMaxLen) {
+                            break;
+                        }
+                    }
+                }
+                node = bucket->suffix[node];
+
+                // end chaining?
+                if (node == 65535 || offset <= (bucket->offset[node] & ~(-1u << m_offset_bits))) {
+                    break;
+                }
+            }
+
+            // a long match is taken as it is: as the only step at the window start, otherwise end the window here
+            if (maxlen >= kOptimalNiceLen) {
+                if (i == 0) {
+                    m_optimal[maxlen].offset = bucket->offset[match_node[matches - 1]] & ~(-1u << m_offset_bits);
+                    m_optimal[maxlen].len = maxlen;
+                    m_optimal[maxlen].node = match_node[matches - 1];
+                    m_optimal_path[0] = 0;
+                    m_optimal_path[1] = maxlen;
+                    steps = 1;
+                    break;
+                }
+                wend = i;
+                break;
+            }
+
+            // matches, each length with the smallest match index
+            for (int m = 0, len = kMatchMinLen; m < matches; m++) {
+                uint32_t idx_price = price + m_prices.matchidx[RollingSub(bucket->head, match_node[m], m_bucket_mask)];
+
+                for (; len <= match_len[m] && (i < wlen || i + len <= wend); len++) {
+                    next = &m_optimal[i + len];
+                    if (idx_price + m_prices.symbol[258 + len - kMatchMinLen] < next->price) {
+                        next->price = idx_price + m_prices.symbol[258 + len - kMatchMinLen];
+                        next->offset = bucket->offset[match_node[m]] & ~(-1u << m_offset_bits);
+                        next->len = len;
+                        next->node = match_node[m];
+                    }
+                }
+            }
+            if (i < wlen && matches > 0) {
+                wend = std::max(wend, i + maxlen);
+            }
+        }
+
+        // literal
+        next = &m_optimal[i + 1];
+        if (price + m_prices.symbol[GetMTF(context)->Peek(ptr[0])] < next->price) {
+            next->price = price + m_prices.symbol[GetMTF(context)->Peek(ptr[0])];
+            next->len = 1;
+        }
+
+        // word
+        if (i + 2 <= wend) {
+            uint16_t word = ptr[0] << 8 | ptr[1];
+            int symbol = (mru[context][0] == word) ? 256 : (mru[context][1] == word) ? 257 : 0;
+
+            next = &m_optimal[i + 2];
+            if (symbol != 0 && price + m_prices.symbol[symbol] < next->price) {
+                next->price = price + m_prices.symbol[symbol];
+                next->len = 2;
+                next->node = symbol;
+            }
+        }
+    }
+
+    // remove window positions from buckets
+    while (updates > 0) {
+        const ZlingOptimalUndo* undo = &m_optimal_undo[--updates];
+        ZlingEncodeBucket* bucket = &m_buckets[undo->context];
+
+        bucket->hash[undo->hash_context] = undo->hash;
+        bucket->suffix[bucket->head] = undo->suffix;
+        bucket->offset[bucket->head] = undo->offset;
+        bucket->head = RollingSub(bucket->head, 1, m_bucket_mask);
+        bucket->filled--;
+    }
+
+    // trace back the path
+    if (steps == 0) {
+        for (int i = wend; i > 0; i -= m_optimal[i].len) {
+            steps++;
+        }
+        m_optimal_path[steps] = wend;
+        for (int step = steps, i = wend; step > 0; ) {
+            i -= m_optimal[i].len;
+            m_optimal_path[--step] = i;
+        }
+    }
+    return steps;
+}
+
+/* on epoch overflow, mark all contexts as unused so no stale epoch can match again. */
+static inline void NextEpoch(uint32_t* epoch, uint32_t* context_epoch) {
+    if (++epoch[0] == 0) {
+        memset(context_epoch, 0, sizeof(uint32_t) * 256);
+        epoch[0] = 1;
+    }
+}
+
 void ZlingRolzEncoder::Reset() {
+    NextEpoch(&m_epoch, m_context_epoch);
+    memset(m_word_mru, 0, sizeof(m_word_mru));
+    return;
+}
+
+void ZlingRolzEncoder::Rewind(unsigned char* ibuf, int ilen, int encpos) {
+    int iend = std::min(encpos, ilen - kMatchMaxLen - 16);  // no position after iend is added, like EncodeStored()
+
+    for (int pos = 2; pos < iend; pos++) {
+        m_buckets[ibuf[pos - 1]].hash[HashContext(ibuf + pos) & m_hash_mask] = 65535;
+    }
     for (int context = 0; context < 256; context++) {
-        for (int i = 0; i < kBucketItemSize; i++) {
-            m_buckets[context].offset[i] = 0;
-            m_buckets[context].suffix[i] = 65535;
+        if (m_context_epoch[context] == m_epoch) {
+            m_buckets[context].head = 0;
+            m_buckets[context].filled = 0;
+            m_mtf[context].Reset();
         }
-        for (int i = 0; i < kBucketItemHash; i++) {
-            m_buckets[context].hash[i] = 65535;
+    }
+    memset(m_word_mru, 0, sizeof(m_word_mru));
+    return;
+}
+
+void ZlingRolzEncoder::Prime(const ZlingRolzDictionary& dictionary) {
+    for (int context = 0; context < 256; context++) {
+        if (dictionary.mtf_primed[context]) {
+            GetMTF(context)->Reset(dictionary.mtf_table[context]);
         }
-        m_buckets[context].head = 0;
     }
+    memcpy(m_word_mru, dictionary.word_mru, sizeof(m_word_mru));
+    return;
+}
+
+void ZlingRolzEncoder::Snapshot(ZlingRolzDictionary* dictionary) const {
+    for (int context = 0; context < 256; context++) {
+        dictionary->mtf_primed[context] = (m_context_epoch[context] == m_epoch);
+
+        for (int c = 0; dictionary->mtf_primed[context] && c < 256; c++) {
+            dictionary->mtf_table[context][m_mtf[context].Peek(c)] = c;
+        }
+    }
+    return;
+}
+
+void ZlingRolzEncoder::ResetContext(unsigned char context) {
+    // suffix/offset entries are always written before being reached from hash, only hash need clearing
+    for (uint32_t i = 0; i <= m_hash_mask; i++) {
+        m_buckets[context].hash[i] = 65535;
+    }
+    m_buckets[context].head = 0;
+    m_buckets[context].filled = 0;
+    m_mtf[context].Reset();
+    m_context_epoch[context] = m_epoch;
     return;
 }
 
+inline ZlingRolzEncoder::ZlingEncodeBucket* ZlingRolzEncoder::GetBucket(unsigned char context) {
+    if (m_context_epoch[context] != m_epoch) {
+        ResetContext(context);
+    }
+    return &m_buckets[context];
+}
+
+inline ZlingMTFEncoder* ZlingRolzEncoder::GetMTF(unsigned char context) {
+    if (m_context_epoch[context] != m_epoch) {
+        ResetContext(context);
+    }
+    return &m_mtf[context];
+}
+
 template<int kMatchDepth, int kLazyMatch1Depth, int kLazyMatch2Depth> int inline ZlingRolzEncoder::MatchAndUpdate(
         unsigned char* buf,
         int pos,
+        const uint32_t* hash_ring,
         int* match_idx,
         int* match_len) {
     int maxlen = kMatchMinLen - 1;
     int maxnode = 0;
-    uint32_t hash = HashContext(buf + pos);
-    uint8_t  hash_check   = hash / kBucketItemHash % 256;
-    uint32_t hash_context = hash % kBucketItemHash;
+    uint32_t hash = hash_ring[pos % kHashRingSize];
+    uint32_t hash_check   = (hash >> m_hash_bits) & ~(-1u << (32 - m_offset_bits));
+    uint32_t hash_context = hash & m_hash_mask;
 
-    ZlingEncodeBucket* bucket = &m_buckets[buf[pos - 1]];
+    ZlingEncodeBucket* bucket = GetBucket(buf[pos - 1]);
     int node = bucket->hash[hash_context];
 
     // update befault matching (to make it faster)
     LIBZLING_DEBUG_COUNT("lz:update_bucket_node", 1);
-    bucket->head = RollingAdd(bucket->head, 1);
+    bucket->head = RollingAdd(bucket->head, 1, m_bucket_mask);
+    bucket->filled++;
     bucket->suffix[bucket->head] = bucket->hash[hash_context];
-    bucket->offset[bucket->head] = pos | hash_check << 24;
+    bucket->offset[bucket->head] = pos | hash_check << m_offset_bits;
     bucket->hash[hash_context] = bucket->head;
 
     // no match for first position
@@ -240,8 +871,8 @@ template<int kMatchDepth, int kLazyMatch1Depth, int kLazyMatch2Depth> int inline
     for (int i = 0; i < kMatchDepth; i++) {
         LIBZLING_DEBUG_COUNT("lz:access_bucket_node", 1);
 
-        uint32_t offset = bucket->offset[node] & 0xffffff;
-        uint8_t  check = bucket->offset[node] >> 24;
+        uint32_t offset = bucket->offset[node] & ~(-1u << m_offset_bits);
+        uint32_t check = bucket->offset[node] >> m_offset_bits;
         if (check == hash_check) {
             LIBZLING_DEBUG_COUNT("lz:access_original_memory", 1);
 
@@ -261,26 +892,28 @@ template<int kMatchDepth, int kLazyMatch1Depth, int kLazyMatch2Depth> int inline
         node = bucket->suffix[node];
 
         // end chaining?
-        if (node == 65535 || offset <= (bucket->offset[node] & 0xffffff)) {
+        if (node == 65535 || offset <= (bucket->offset[node] & ~(-1u << m_offset_bits))) {
             break;
         }
     }
 
     if (maxlen >= kMatchMinLen) {
         if (maxlen < kMatchMinLenEnableLazy) {  // fast and stupid lazy parsing
-            if (kLazyMatch1Depth > 0 && MatchLazy(buf, pos + 1, maxlen, kLazyMatch1Depth)) {
+            if (kLazyMatch1Depth > 0
+                && MatchLazy(buf, pos + 1, hash_ring[(pos + 1) % kHashRingSize], maxlen, kLazyMatch1Depth)) {
                 LIBZLING_DEBUG_COUNT("lz:lazy_skip_1", 1);
                 LIBZLING_DEBUG_COUNT("lz:match_fail", 1);
                 return 0;
             }
-            if (kLazyMatch2Depth > 0 && MatchLazy(buf, pos + 2, maxlen, kLazyMatch2Depth)) {
+            if (kLazyMatch2Depth > 0
+                && MatchLazy(buf, pos + 2, hash_ring[(pos + 2) % kHashRingSize], maxlen, kLazyMatch2Depth)) {
                 LIBZLING_DEBUG_COUNT("lz:lazy_skip_2", 1);
                 LIBZLING_DEBUG_COUNT("lz:match_fail", 1);
                 return 0;
             }
         }
         match_len[0] = maxlen;
-        match_idx[0] = RollingSub(bucket->head, maxnode);
+        match_idx[0] = RollingSub(bucket->head, maxnode, m_bucket_mask);
         LIBZLING_DEBUG_COUNT("lz:match_succ", 1);
         return 1;
     }
@@ -288,10 +921,35 @@ template<int kMatchDepth, int kLazyMatch1Depth, int kLazyMatch2Depth> int inline
     return 0;
 }
 
-int inline ZlingRolzEncoder::MatchLazy(unsigned char* buf, int pos, int maxlen, int depth) {
-    ZlingEncodeBucket* bucket = &m_buckets[buf[pos - 1]];
-    uint32_t hash = HashContext(buf + pos);
-    uint32_t hash_context = hash % kBucketItemHash;
+inline void ZlingRolzEncoder::PrefetchHash(unsigned char* buf, int pos, uint32_t hash) {
+    cpu::Prefetch(&m_buckets[buf[pos - 1]].hash[hash & m_hash_mask]);
+}
+
+inline void ZlingRolzEncoder::PrefetchChain(unsigned char* buf, int pos, uint32_t hash) {
+    unsigned char context = buf[pos - 1];
+    ZlingEncodeBucket* bucket = &m_buckets[context];
+    int node = bucket->hash[hash & m_hash_mask];
+
+    // only follow heads of contexts in use, others may point to entries never written
+    if (m_context_epoch[context] == m_epoch && node != 65535) {
+        cpu::Prefetch(&bucket->offset[node]);
+        cpu::Prefetch(&bucket->suffix[node]);
+    }
+}
+
+inline void ZlingRolzEncoder::PrefetchCandidate(unsigned char* buf, int pos, uint32_t hash) {
+    unsigned char context = buf[pos - 1];
+    ZlingEncodeBucket* bucket = &m_buckets[context];
+    int node = bucket->hash[hash & m_hash_mask];
+
+    if (m_context_epoch[context] == m_epoch && node != 65535) {
+        cpu::Prefetch(buf + (bucket->offset[node] & ~(-1u << m_offset_bits)));
+    }
+}
+
+int inline ZlingRolzEncoder::MatchLazy(unsigned char* buf, int pos, uint32_t hash, int maxlen, int depth) {
+    ZlingEncodeBucket* bucket = GetBucket(buf[pos - 1]);
+    uint32_t hash_context = hash & m_hash_mask;
 
     int node = bucket->hash[hash_context];
     if (node == 65535) {
@@ -300,7 +958,7 @@ int inline ZlingRolzEncoder::MatchLazy(unsigned char* buf, int pos, int maxlen,
     maxlen -= 3;
 
     for (int i = 0; i < depth; i++) {
-        uint32_t offset = bucket->offset[node] & 0xffffff;
+        uint32_t offset = bucket->offset[node] & ~(-1u << m_offset_bits);
 
         if (*reinterpret_cast<uint32_t*>(buf + pos + maxlen) == *reinterpret_cast<uint32_t*>(buf + offset + maxlen)) {
             return 1;
@@ -308,20 +966,45 @@ int inline ZlingRolzEncoder::MatchLazy(unsigned char* buf, int pos, int maxlen,
         node = bucket->suffix[node];
 
         // end chaining?
-        if (node == 65535 || offset <= (bucket->offset[node] & 0xffffff)) {
+        if (node == 65535 || offset <= (bucket->offset[node] & ~(-1u << m_offset_bits))) {
             break;
         }
     }
     return 0;
 }
 
+ZlingRolzDecoder::ZlingRolzDecoder(int bucket_size, Allocator* allocator):
+    m_bucket_epoch(0),
+    m_mtf_epoch(0),
+    m_allocator(allocator),
+    m_offset_data(static_cast<uint32_t*>(allocator->Allocate(256 * bucket_size * sizeof(uint32_t)))),
+    m_bucket_mask(bucket_size - 1) {
+
+    for (int context = 0; context < 256; context++) {
+        m_buckets[context].offset = m_offset_data + context * bucket_size;
+    }
+    memset(m_context_bucket_epoch, 0, sizeof(m_context_bucket_epoch));
+    memset(m_context_mtf_epoch, 0, sizeof(m_context_mtf_epoch));
+    Reset();
+}
+
+ZlingRolzDecoder::~ZlingRolzDecoder() {
+    m_allocator->Free(m_offset_data, 256 * (m_bucket_mask + 1) * sizeof(uint32_t));
+}
+
+size_t ZlingRolzDecoder::GetMemorySize(int bucket_size) {
+    return sizeof(ZlingRolzDecoder) + 256 * bucket_size * sizeof(uint32_t);
+}
+
 int ZlingRolzDecoder::Decode(uint16_t* ibuf, unsigned char* obuf, int ilen, int encpos, int* decpos) {
     int opos = decpos[0];
     int ipos = 0;
     int match_idx;
     int match_len;
     int match_offset;
-    uint16_t word_mru[256][2] = {};
+    uint16_t word_mru[256][2];
+
+    memcpy(word_mru, m_word_mru, sizeof(word_mru));
 
     // first byte
     if (opos == 0 && ipos < ilen) obuf[opos++] = ibuf[ipos++];
@@ -330,7 +1013,7 @@ int ZlingRolzDecoder::Decode(uint16_t* ibuf, unsigned char* obuf, int ilen, int
     // rest byte
     while (ipos < ilen) {
         if (ibuf[ipos] < 256) {  // process a literal byte
-            obuf[opos] = m_mtf[obuf[opos - 1]].Decode(ibuf[ipos]);
+            obuf[opos] = GetMTF(obuf[opos - 1])->Decode(ibuf[ipos]);
             ipos++;
             GetMatchAndUpdate(obuf, opos++, 0);
             word_mru[obuf[opos - 3]][1] = word_mru[obuf[opos - 3]][0];
@@ -354,7 +1037,14 @@ int ZlingRolzDecoder::Decode(uint16_t* ibuf, unsigned char* obuf, int ilen, int
             match_len = ibuf[ipos++] - 258 + kMatchMinLen;
             match_idx = ibuf[ipos++];
             match_offset = GetMatchAndUpdate(obuf, opos, match_idx);
+            if (match_offset >= opos) {  // corrupted input, would copy from itself
+                return -1;
+            }
 
+            // the next symbol is a match: fetch its source while this copy is running
+            if (ipos + 1 < ilen && ibuf[ipos] >= 258 && opos - match_offset >= match_len) {
+                PrefetchMatch(obuf, obuf[match_offset + match_len - 1], ibuf[ipos + 1]);
+            }
             IncrementalCopyFastPath(&obuf[match_offset], &obuf[opos], match_len);
             opos += match_len;
             if (word_mru[obuf[opos - 3]][0] != (obuf[opos - 2] << 8 | obuf[opos - 1])) {
@@ -375,26 +1065,77 @@ int ZlingRolzDecoder::Decode(uint16_t* ibuf, unsigned char* obuf, int ilen, int
     return 0;
 }
 
-void ZlingRolzDecoder::Reset() {
+void ZlingRolzDecoder::Reset(bool reset_mtf) {
+    NextEpoch(&m_bucket_epoch, m_context_bucket_epoch);
+    if (reset_mtf) {
+        NextEpoch(&m_mtf_epoch, m_context_mtf_epoch);
+    }
+    memset(m_word_mru, 0, sizeof(m_word_mru));
+    return;
+}
+
+void ZlingRolzDecoder::Prime(const ZlingRolzDictionary& dictionary) {
     for (int context = 0; context < 256; context++) {
-        for (int i = 0; i < kBucketItemSize; i++) {
-            m_buckets[context].offset[i] = 0;
+        if (dictionary.mtf_primed[context]) {
+            GetMTF(context)->Reset(dictionary.mtf_table[context]);
         }
-        m_buckets[context].head = 0;
     }
+    memcpy(m_word_mru, dictionary.word_mru, sizeof(m_word_mru));
     return;
 }
 
+inline ZlingRolzDecoder::ZlingDecodeBucket* ZlingRolzDecoder::GetBucket(unsigned char context) {
+    if (m_context_bucket_epoch[context] != m_bucket_epoch) {
+        // offsets are only cleared to keep decoding of corrupted input deterministic
+        memset(m_buckets[context].offset, 0, sizeof(uint32_t) * (m_bucket_mask + 1));
+        m_buckets[context].head = 0;
+        m_context_bucket_epoch[context] = m_bucket_epoch;
+    }
+    return &m_buckets[context];
+}
+
+inline ZlingMTFDecoder* ZlingRolzDecoder::GetMTF(unsigned char context) {
+    if (m_context_mtf_epoch[context] != m_mtf_epoch) {
+        m_mtf[context].Reset();
+        m_context_mtf_epoch[context] = m_mtf_epoch;
+    }
+    return &m_mtf[context];
+}
+
+inline void ZlingRolzDecoder::PrefetchMatch(unsigned char* buf, unsigned char context, int idx) {
+    if (m_context_bucket_epoch[context] == m_bucket_epoch) {  // otherwise the bucket is about to be cleared
+        ZlingDecodeBucket* bucket = &m_buckets[context];
+        cpu::Prefetch(buf + bucket->offset[RollingSub(bucket->head + 1, idx, m_bucket_mask)]);
+    }
+}
+
+int ZlingRolzDecoder::DecodeStored(const unsigned char* ibuf, unsigned char* obuf, int ilen, int encpos, int* decpos) {
+    if (decpos[0] + ilen != encpos) {
+        return -1;
+    }
+    memcpy(obuf + decpos[0], ibuf, ilen);
+
+    // positions after the encoder's last matching position are also added, they are never referenced
+    for (int opos = std::max(decpos[0], 2); opos < encpos; opos++) {
+        ZlingDecodeBucket* bucket = GetBucket(obuf[opos - 1]);
+
+        bucket->head = RollingAdd(bucket->head, 1, m_bucket_mask);
+        bucket->offset[bucket->head] = opos;
+    }
+    decpos[0] = encpos;
+    return 0;
+}
+
 int inline ZlingRolzDecoder::GetMatchAndUpdate(unsigned char* buf, int pos, int idx) {
-    ZlingDecodeBucket* bucket = &m_buckets[buf[pos - 1]];
+    ZlingDecodeBucket* bucket = GetBucket(buf[pos - 1]);
     int node;
 
     // update
-    bucket->head = RollingAdd(bucket->head, 1);
+    bucket->head = RollingAdd(bucket->head, 1, m_bucket_mask);
     bucket->offset[bucket->head] = pos;
 
     // get match
-    node = RollingSub(bucket->head, idx);
+    node = RollingSub(bucket->head, idx, m_bucket_mask);
     return bucket->offset[node];
 }
 
@@ -36,21 +36,53 @@
 #define SRC_LIBZLING_LZ_H
 
 #include "libzling_inc.h"
+#include "libzling_utils.h"
 
 namespace baidu {
 namespace zling {
 namespace lz {
 
-static const int kBucketItemSize = 4096;
-static const int kBucketItemHash = 8192;
+static const int kBucketItemSize = 4096;  /* default and max (limited by matchidx codes) */
+static const int kBucketItemHash = 8192;  /* default */
+static const int kBucketOffsetBits = 24;  /* default, offsets are stored with (32 - bits) hash check bits */
 static const int kMatchMinLenEnableLazy = 128;
 static const int kMatchMinLen = 4;
 static const int kMatchMaxLen = 259;
 
+/* optimal parsing (level 5): parsed in windows of kOptimalWindow positions (extended until all
+ * matches crossing the window end are finished), a window also ends before a match of
+ * kOptimalNiceLen (which is taken as it is).
+ */
+static const int kOptimalWindow = 64;
+static const int kOptimalNiceLen = 32;
+static const int kOptimalDepth = 32;
+
+/* ZlingRolzPrices: costs (in bits) of output symbols, used by optimal parsing. */
+struct ZlingRolzPrices {
+    uint16_t symbol[258 + kMatchMaxLen - kMatchMinLen + 1];  /* MTF-coded literals, words and match lengths */
+    uint16_t matchidx[kBucketItemSize];                      /* match indexes, including ex-bits */
+};
+
+/* Log2: smallest bits with (1 << bits) >= x */
+static inline int Log2(uint32_t x) {
+    int bits = 0;
+    while ((1u << bits) < x) {
+        bits++;
+    }
+    return bits;
+}
+
 class ZlingMTFEncoder {
 public:
     ZlingMTFEncoder();
     unsigned char Encode(unsigned char c);
+    void Reset();
+    void Reset(const unsigned char* table);  /* start with table[i]: symbol of index i */
+
+    /* Peek: the output of Encode(c) without updating the table */
+    inline unsigned char Peek(unsigned char c) const {
+        return m_index[c];
+    }
 private:
     unsigned char m_table[256];
     unsigned char m_index[256];
@@ -60,17 +92,47 @@ class ZlingMTFDecoder {
 public:
     ZlingMTFDecoder();
     unsigned char Decode(unsigned char i);
+    void Reset();
+    void Reset(const unsigned char* table);
 private:
     unsigned char m_table[256];
 };
 
+/* ZlingRolzDictionary: ROLZ state primed with a preset dictionary, built once and shared by any number
+ *  of encoders/decoders (see Prime()).
+ *  MTF tables are taken from an encoder which encoded the dictionary (ZlingRolzEncoder::Snapshot()),
+ *  word MRU has the last words of the dictionary. buckets are primed by EncodeStored()/DecodeStored()
+ *  of the dictionary, placed in front of block data.
+ */
+struct ZlingRolzDictionary {
+    ZlingRolzDictionary(const unsigned char* buf, int len);  /* MTF tables are not primed until Snapshot() */
+
+    std::vector<unsigned char> data;
+    unsigned char mtf_table[256][256];
+    bool mtf_primed[256];
+    uint16_t word_mru[256][2];
+};
+
 class ZlingRolzEncoder {
 public:
-    ZlingRolzEncoder(int compression_level = 0) {
-        Reset();
-    }
+    /* ZlingRolzEncoder:
+     *  arg bucket_size: items per bucket (power of 2, <= kBucketItemSize), matchidx < bucket_size
+     *  arg bucket_hash: hash heads per bucket (power of 2, <= 65536)
+     *  arg offset_bits: bits of input positions, input length must be <= (1 << offset_bits)
+     *  arg allocator:   allocator of bucket arrays
+     */
+    ZlingRolzEncoder(int bucket_size = kBucketItemSize, int bucket_hash = kBucketItemHash,
+                     int offset_bits = kBucketOffsetBits,
+                     Allocator* allocator = GetDefaultAllocator());
+    ~ZlingRolzEncoder();
+
+    /* GetMemorySize: bytes allocated by a ZlingRolzEncoder with the given geometry */
+    static size_t GetMemorySize(int bucket_size, int bucket_hash);
 
     /* Encode:
+     *  arg level:  -1:   a single hash probe per position, for speed.
+     *              0..4: greedy matching with lazy checks, deeper for bigger level.
+     *              5:    optimal parsing with prices from SetPrices().
      *  arg ibuf:   input data
      *  arg obuf:   output data (compressed)
      *  arg ilen:   input data length
@@ -79,8 +141,30 @@ public:
      *  ret: out length.
      */
     int Encode(int level, unsigned char* ibuf, uint16_t* obuf, int ilen, int olen, int* encpos);
+
+    /* EncodeStored: skip ibuf[encpos..encpos+len) without coding it (stored sub-blocks).
+     *  positions are still added to buckets, so following data can match them.
+     */
+    void EncodeStored(unsigned char* ibuf, int ilen, int len, int* encpos);
+
+    /* SetPrices: symbol costs used by following Encode() calls with level 5, usually taken from
+     *  HUFFMAN tables of the previous sub-block.
+     */
+    void SetPrices(const ZlingRolzPrices& prices);
     void Reset();
 
+    /* Rewind: return to the state of Reset() after encoding ibuf[0..encpos) since it. only hash heads
+     *  of these positions are cleared, while contexts reset in a new epoch clear whole hash tables,
+     *  so short trial encodes (see automatic levels) are cheap to repeat.
+     */
+    void Rewind(unsigned char* ibuf, int ilen, int encpos);
+
+    /* Prime: start with MTF tables and word MRU of dictionary, called after Reset(). */
+    void Prime(const ZlingRolzDictionary& dictionary);
+
+    /* Snapshot: keep MTF tables of contexts used since Reset() in dictionary. */
+    void Snapshot(ZlingRolzDictionary* dictionary) const;
+
 private:
     template<int kMatchDepth, int kLazyMatch1Depth, int kLazyMatch2Depth> int EncodeImpl(
             unsigned char* ibuf,
@@ -91,18 +175,86 @@ private:
     template<int kMatchDepth, int kLazyMatch1Depth, int kLazyMatch2Depth> int MatchAndUpdate(
             unsigned char* buf,
             int pos,
+            const uint32_t* hash_ring,
             int* match_idx,
             int* match_len);
-    int MatchLazy(unsigned char* buf, int pos, int maxlen, int depth);
+    int MatchLazy(unsigned char* buf, int pos, uint32_t hash, int maxlen, int depth);
+    int EncodeFast(unsigned char* ibuf, uint16_t* obuf, int ilen, int olen, int* encpos);
+    int EncodeOptimal(unsigned char* ibuf, uint16_t* obuf, int ilen, int olen, int* encpos);
+    int ParseOptimal(unsigned char* buf, int pos, int end, uint16_t word_mru[256][2]);
+
+    /* prefetch pipeline of a position ahead of the parser, each stage relies on the previous
+     * one issued a few positions earlier:
+     *  PrefetchHash:      the hash head slot
+     *  PrefetchChain:     the first chain node's offset and suffix entries
+     *  PrefetchCandidate: the input bytes of the first chain node
+     * each position is hashed once into a ring (see EncodeImpl()), shared by the stages and matching.
+     */
+    inline void PrefetchHash(unsigned char* buf, int pos, uint32_t hash);
+    inline void PrefetchChain(unsigned char* buf, int pos, uint32_t hash);
+    inline void PrefetchCandidate(unsigned char* buf, int pos, uint32_t hash);
 
+    /* ZlingEncodeBucket: chains of a context, kept as separate arrays in the context's slab.
+     *  offset[node]: input position | hash check << m_offset_bits
+     *  suffix[node]: next (older) node of the chain
+     *  hash[]:       chain heads, per context so that a context can be reset alone
+     *  filled:       number of nodes added since the context was reset, nodes at a distance of
+     *                filled or more behind head are left from an earlier epoch
+     * packed {offset, next} nodes (6 or 8 bytes) were slower at every level: most probes are
+     * rejected by offset[] alone, and the bigger nodes only grow the per-context footprint.
+     */
     struct ZlingEncodeBucket {
-        uint16_t suffix[kBucketItemSize];
-        uint32_t offset[kBucketItemSize];
+        uint16_t* suffix;
+        uint32_t* offset;
+        uint16_t* hash;
         uint16_t head;
-        uint16_t hash[kBucketItemHash];
+        uint32_t filled;
+    };
+
+    /* buckets and MTF tables are reset lazily: Reset() starts a new epoch, and a context is
+     * reset on its first use in the epoch. contexts never seen cost nothing.
+     */
+    inline ZlingEncodeBucket* GetBucket(unsigned char context);
+    inline ZlingMTFEncoder* GetMTF(unsigned char context);
+    inline ZlingEncodeBucket* Update(unsigned char* buf, int pos);
+    int MatchReplace(unsigned char* buf, int pos, ZlingEncodeBucket* bucket, int maxlen, int* match_node);
+    void ResetContext(unsigned char context);
+    void Free();
+
+    /* optimal parsing node of a window position: the cheapest step arriving at it */
+    struct ZlingOptimalNode {
+        uint32_t price;
+        uint32_t offset;  /* match: source position */
+        uint16_t len;     /* 1: literal, 2: word, >= kMatchMinLen: match */
+        uint16_t node;    /* word: symbol (256/257), match: bucket node */
+    };
+    ZlingOptimalNode m_optimal[kOptimalWindow + kMatchMaxLen + 1];
+    uint16_t m_optimal_path[kOptimalWindow + kMatchMaxLen + 1];  /* step positions (relative to window) and window end */
+
+    /* bucket entries overwritten by ParseOptimal(), restored before the path is encoded */
+    struct ZlingOptimalUndo {
+        uint32_t offset;
+        uint16_t suffix;
+        uint16_t hash;
+        uint16_t hash_context;
+        unsigned char context;
     };
+    ZlingOptimalUndo m_optimal_undo[kOptimalWindow + kMatchMaxLen];
+    ZlingRolzPrices m_prices;
+
     ZlingEncodeBucket m_buckets[256];
     ZlingMTFEncoder m_mtf[256];
+    uint32_t m_epoch;
+    uint32_t m_context_epoch[256];
+    uint16_t m_word_mru[256][2];  /* word MRU at the start of each Encode() */
+
+    Allocator* m_allocator;
+    unsigned char* m_bucket_data;  /* buckets are laid out one after another: offset[], suffix[], hash[] */
+    size_t m_bucket_stride;
+    uint32_t m_bucket_mask;
+    uint32_t m_hash_mask;
+    int m_hash_bits;
+    int m_offset_bits;
 
     ZlingRolzEncoder(const ZlingRolzEncoder&);
     ZlingRolzEncoder& operator = (const ZlingRolzEncoder&);
@@ -110,9 +262,15 @@ private:
 
 class ZlingRolzDecoder {
 public:
-    ZlingRolzDecoder() {
-        Reset();
-    }
+    /* ZlingRolzDecoder:
+     *  arg bucket_size: same as ZlingRolzEncoder
+     *  arg allocator:   same as ZlingRolzEncoder
+     */
+    ZlingRolzDecoder(int bucket_size = kBucketItemSize, Allocator* allocator = GetDefaultAllocator());
+    ~ZlingRolzDecoder();
+
+    /* GetMemorySize: bytes allocated by a ZlingRolzDecoder with the given geometry */
+    static size_t GetMemorySize(int bucket_size);
 
     /* Decode:
      *  arg ibuf:   input data (compressed)
@@ -124,17 +282,51 @@ public:
      *        0: success
      */
     int Decode(uint16_t* ibuf, unsigned char* obuf, int ilen, int encpos, int* decpos);
-    void Reset();
+
+    /* DecodeStored: copy raw data of a stored sub-block, updating buckets like ZlingRolzEncoder::EncodeStored.
+     *  arg ibuf:   input data (raw)
+     *  arg obuf:   output data
+     *  arg ilen:   input data length
+     *  arg encpos: encpos check
+     *  arg decpos: start decoding at obuf[decpos]
+     *  ret: -1: failed
+     *        0: success
+     */
+    int DecodeStored(const unsigned char* ibuf, unsigned char* obuf, int ilen, int encpos, int* decpos);
+
+    /* Reset:
+     *  arg reset_mtf: also reset MTF tables (streams before version 1 keep them across blocks)
+     */
+    void Reset(bool reset_mtf = true);
+
+    /* Prime: same as ZlingRolzEncoder::Prime() */
+    void Prime(const ZlingRolzDictionary& dictionary);
 
 private:
     int GetMatchAndUpdate(unsigned char* buf, int pos, int idx);
+    void PrefetchMatch(unsigned char* buf, unsigned char context, int idx);
 
     struct ZlingDecodeBucket {
-        uint32_t offset[kBucketItemSize];
+        uint32_t* offset;
         uint16_t head;
     };
+
+    /* reset lazily like ZlingRolzEncoder, with separated epochs for buckets and MTF tables. */
+    inline ZlingDecodeBucket* GetBucket(unsigned char context);
+    inline ZlingMTFDecoder* GetMTF(unsigned char context);
+
     ZlingDecodeBucket m_buckets[256];
     ZlingMTFDecoder m_mtf[256];
+    uint32_t m_bucket_epoch;
+    uint32_t m_mtf_epoch;
+    uint32_t m_context_bucket_epoch[256];
+    uint32_t m_context_mtf_epoch[256];
+    uint16_t m_word_mru[256][2];
+
+    Allocator* m_allocator;
+    uint32_t* m_offset_data;
+    uint32_t m_bucket_mask;
+
     ZlingRolzDecoder(const ZlingRolzDecoder&);
     ZlingRolzDecoder& operator = (const ZlingRolzDecoder&);
 };
@@ -0,0 +1,397 @@
+/**
+ * zling:
+ *  light-weight lossless data compression utility.
+ *
+ * Copyright (C) 2012-2013 by Zhang Li <zhangli10 at baidu.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @author zhangli10<zhangli10@baidu.com>
+ * @brief  manipulate worker threads.
+ */
+#include "libzling_thread.h"
+
+namespace baidu {
+namespace zling {
+namespace thread {
+
+static thread_local const ZlingThreadPool* t_pool = NULL;
+static thread_local int t_worker_index = -1;
+
+ZlingThreadPool::ZlingThreadPool(int thread_num):
+    m_pending(0),
+    m_next_worker(0),
+    m_stop(false) {
+
+    for (int i = 0; i < thread_num; i++) {
+        m_workers.push_back(std::unique_ptr<Worker>(new Worker()));
+    }
+    for (int i = 0; i < thread_num; i++) {
+        m_threads.push_back(std::thread(&ZlingThreadPool::WorkerLoop, this, i));
+    }
+}
+
+ZlingThreadPool::~ZlingThreadPool() {
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cond.notify_all();
+
+    for (size_t i = 0; i < m_threads.size(); i++) {
+        m_threads[i].join();
+    }
+}
+
+std::future<void> ZlingThreadPool::Submit(const std::function<void ()>& task, bool urgent) {
+    auto packaged_task = std::make_shared<std::packaged_task<void ()> >(task);
+    auto future = packaged_task->get_future();
+    auto wrapped_task = [packaged_task]() {
+        (*packaged_task)();
+    };
+
+    if (urgent) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_urgent_tasks.push_back(wrapped_task);
+        m_pending += 1;
+
+    } else {
+        int index = GetWorkerIndex();
+        if (index == -1) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            index = m_next_worker++ % m_workers.size();
+        }
+        {
+            std::unique_lock<std::mutex> lock(m_workers[index]->mutex);
+            m_workers[index]->tasks.push_back(wrapped_task);
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_pending += 1;
+    }
+    m_cond.notify_one();
+    return future;
+}
+
+void ZlingThreadPool::Wait(std::future<void>& future) {
+    while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        if (!RunUrgentTask()) {
+            future.wait();
+        }
+    }
+    future.get();
+    return;
+}
+
+int ZlingThreadPool::GetWorkerIndex() const {
+    return (t_pool == this) ? t_worker_index : -1;
+}
+
+bool ZlingThreadPool::RunUrgentTask() {
+    std::function<void ()> task;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_urgent_tasks.empty()) {
+            return false;
+        }
+        task = m_urgent_tasks.front();
+        m_urgent_tasks.pop_front();
+        m_pending -= 1;
+    }
+    task();
+    return true;
+}
+
+bool ZlingThreadPool::RunTask(int index) {
+    if (RunUrgentTask()) {
+        return true;
+    }
+
+    // own tasks are taken from the front, other workers' tasks are stolen from the back
+    for (size_t i = 0; i < m_workers.size(); i++) {
+        Worker* worker = m_workers[(index + i) % m_workers.size()].get();
+        std::function<void ()> task;
+        {
+            std::unique_lock<std::mutex> lock(worker->mutex);
+            if (worker->tasks.empty()) {
+                continue;
+            }
+            if (i == 0) {
+                task = worker->tasks.front();
+                worker->tasks.pop_front();
+            } else {
+                task = worker->tasks.back();
+                worker->tasks.pop_back();
+            }
+        }
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_pending -= 1;
+        }
+        task();
+        return true;
+    }
+    return false;
+}
+
+void ZlingThreadPool::WorkerLoop(int index) {
+    t_pool = this;
+    t_worker_index = index;
+
+    while (true) {
+        if (RunTask(index)) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this]() {
+            return m_stop || m_pending > 0;
+        });
+        if (m_stop && m_pending == 0) {  // queued tasks are drained before exiting
+            return;
+        }
+    }
+}
+
+ZlingPipelinedInputter::ZlingPipelinedInputter(Inputter* inputter, size_t chunk_size, int chunk_num):
+    m_inputter(inputter),
+    m_chunks(chunk_num),
+    m_total_read(inputter->GetInputSize()),
+    m_ridx(0),
+    m_rpos(0),
+    m_rheld(false),
+    m_done(false),
+    m_stop(false),
+    m_err(false) {
+
+    for (size_t i = 0; i < m_chunks.size(); i++) {
+        m_chunks[i].buf.resize(chunk_size);
+        m_chunks[i].len = 0;
+        m_chunks[i].filled = false;
+    }
+    m_thread = std::thread(&ZlingPipelinedInputter::IOLoop, this);
+}
+
+ZlingPipelinedInputter::~ZlingPipelinedInputter() {
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+}
+
+size_t ZlingPipelinedInputter::GetData(unsigned char* buf, size_t len) {
+    size_t n = 0;
+
+    while (n < len) {
+        if (!m_rheld || m_rpos == m_chunks[m_ridx].len) {
+            if (!NextChunk()) {
+                break;
+            }
+        }
+        size_t copy_len = std::min(len - n, m_chunks[m_ridx].len - m_rpos);
+        memcpy(buf + n, &m_chunks[m_ridx].buf[m_rpos], copy_len);
+        m_rpos += copy_len;
+        n += copy_len;
+    }
+    m_total_read += n;
+    return n;
+}
+
+bool ZlingPipelinedInputter::IsEnd() {
+    if (m_rheld && m_rpos < m_chunks[m_ridx].len) {
+        return false;
+    }
+    return !NextChunk();
+}
+
+bool ZlingPipelinedInputter::IsErr() {
+    return m_err;
+}
+
+size_t ZlingPipelinedInputter::GetInputSize() {
+    return m_total_read;
+}
+
+bool ZlingPipelinedInputter::NextChunk() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    // release current chunk to the I/O thread
+    if (m_rheld) {
+        m_chunks[m_ridx].filled = false;
+        m_ridx = (m_ridx + 1) % m_chunks.size();
+        m_rpos = 0;
+        m_rheld = false;
+        m_cond.notify_all();
+    }
+    m_cond.wait(lock, [this]() {
+        return m_chunks[m_ridx].filled || m_done;
+    });
+    m_rheld = m_chunks[m_ridx].filled;
+    return m_rheld;
+}
+
+void ZlingPipelinedInputter::IOLoop() {
+    for (size_t idx = 0; ; idx = (idx + 1) % m_chunks.size()) {
+        Chunk* chunk = &m_chunks[idx];
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [this, chunk]() {
+                return !chunk->filled || m_stop;
+            });
+            if (m_stop) {
+                return;
+            }
+        }
+
+        // fill chunk
+        chunk->len = 0;
+        while (chunk->len < chunk->buf.size() && !m_inputter->IsEnd() && !m_inputter->IsErr()) {
+            chunk->len += m_inputter->GetData(&chunk->buf[chunk->len], chunk->buf.size() - chunk->len);
+        }
+        m_err = m_inputter->IsErr();
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            chunk->filled = (chunk->len > 0);
+            m_done = (chunk->len < chunk->buf.size());
+            m_cond.notify_all();
+
+            if (m_done) {
+                return;
+            }
+        }
+    }
+}
+
+ZlingPipelinedOutputter::ZlingPipelinedOutputter(Outputter* outputter, size_t chunk_size, int chunk_num):
+    m_outputter(outputter),
+    m_chunks(chunk_num),
+    m_total_write(outputter->GetOutputSize()),
+    m_widx(0),
+    m_nfilled(0),
+    m_stop(false),
+    m_err(false) {
+
+    for (size_t i = 0; i < m_chunks.size(); i++) {
+        m_chunks[i].buf.resize(chunk_size);
+        m_chunks[i].len = 0;
+        m_chunks[i].filled = false;
+    }
+    m_thread = std::thread(&ZlingPipelinedOutputter::IOLoop, this);
+}
+
+ZlingPipelinedOutputter::~ZlingPipelinedOutputter() {
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+}
+
+size_t ZlingPipelinedOutputter::PutData(unsigned char* buf, size_t len) {
+    size_t n = 0;
+
+    while (n < len) {
+        Chunk* chunk = &m_chunks[m_widx];
+        size_t copy_len = std::min(len - n, chunk->buf.size() - chunk->len);
+
+        memcpy(&chunk->buf[chunk->len], buf + n, copy_len);
+        chunk->len += copy_len;
+        n += copy_len;
+
+        if (chunk->len == chunk->buf.size()) {
+            NextChunk();
+        }
+    }
+    m_total_write += n;
+    return n;
+}
+
+bool ZlingPipelinedOutputter::IsErr() {
+    return m_err;
+}
+
+size_t ZlingPipelinedOutputter::GetOutputSize() {
+    return m_total_write;
+}
+
+void ZlingPipelinedOutputter::Flush() {
+    if (m_chunks[m_widx].len > 0) {
+        NextChunk();
+    }
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cond.wait(lock, [this]() {
+        return m_nfilled == 0;
+    });
+    return;
+}
+
+void ZlingPipelinedOutputter::NextChunk() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    // hand over current chunk to the I/O thread
+    m_chunks[m_widx].filled = true;
+    m_nfilled += 1;
+    m_widx = (m_widx + 1) % m_chunks.size();
+    m_cond.notify_all();
+
+    m_cond.wait(lock, [this]() {
+        return !m_chunks[m_widx].filled;
+    });
+    m_chunks[m_widx].len = 0;
+    return;
+}
+
+void ZlingPipelinedOutputter::IOLoop() {
+    for (size_t idx = 0; ; idx = (idx + 1) % m_chunks.size()) {
+        Chunk* chunk = &m_chunks[idx];
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [this, chunk]() {
+                return chunk->filled || m_stop;
+            });
+            if (!chunk->filled) {
+                return;
+            }
+        }
+
+        // write chunk, data is dropped after an error
+        for (size_t ooff = 0; !m_err && ooff < chunk->len; ) {
+            ooff += m_outputter->PutData(&chunk->buf[ooff], chunk->len - ooff);
+            m_err = m_outputter->IsErr();
+        }
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            chunk->filled = false;
+            m_nfilled -= 1;
+            m_cond.notify_all();
+        }
+    }
+}
+
+}  // namespace thread
+}  // namespace zling
+}  // namespace baidu
@@ -0,0 +1,180 @@
+/**
+ * zling:
+ *  light-weight lossless data compression utility.
+ *
+ * Copyright (C) 2012-2013 by Zhang Li <zhangli10 at baidu.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @author zhangli10<zhangli10@baidu.com>
+ * @brief  manipulate worker threads.
+ */
+#ifndef SRC_LIBZLING_THREAD_H
+#define SRC_LIBZLING_THREAD_H
+
+#include "libzling_inc.h"
+#include "libzling_utils.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace baidu {
+namespace zling {
+namespace thread {
+
+/* ZlingThreadPool: fixed-size work-stealing pool of worker threads.
+ *  Submit():         queue a task, the returned future is ready when the task finished,
+ *                    exceptions thrown by the task are rethrown by future.get().
+ *                    tasks are queued to the submitting worker (or round-robin from other threads),
+ *                    idle workers steal tasks from the others.
+ *                    urgent tasks are run before others and must not wait for other tasks.
+ *  Wait():           wait for a future, running urgent tasks in the calling thread meanwhile.
+ *  GetWorkerIndex(): index of the calling worker thread in [0, thread_num), -1 for other threads.
+ *
+ *  on destruction, queued tasks (including tasks they submit) are drained, then the workers are joined.
+ */
+class ZlingThreadPool {
+public:
+    ZlingThreadPool(int thread_num);
+    ~ZlingThreadPool();
+
+    std::future<void> Submit(const std::function<void ()>& task, bool urgent = false);
+    void Wait(std::future<void>& future);
+    int GetWorkerIndex() const;
+
+    inline int GetThreadNum() const {
+        return m_threads.size();
+    }
+
+private:
+    struct Worker {
+        std::deque<std::function<void ()> > tasks;
+        std::mutex mutex;
+    };
+    bool RunUrgentTask();
+    bool RunTask(int index);
+    void WorkerLoop(int index);
+
+    std::vector<std::thread> m_threads;
+    std::vector<std::unique_ptr<Worker> > m_workers;
+    std::deque<std::function<void ()> > m_urgent_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    size_t m_pending;
+    size_t m_next_worker;
+    bool m_stop;
+
+    ZlingThreadPool(const ZlingThreadPool&);
+    ZlingThreadPool& operator = (const ZlingThreadPool&);
+};
+
+/* ZlingPipelinedInputter/ZlingPipelinedOutputter:
+ *  read-ahead/write-behind wrappers of Inputter/Outputter. an I/O thread moves data
+ *  between the wrapped inputter/outputter and a ring of chunk_num chunks, so I/O
+ *  overlaps with the codec thread.
+ *
+ *  the wrapped inputter/outputter must not be used until the wrapper is destroyed
+ *  (or Flush()-ed for outputter). GetInputSize()/GetOutputSize() count data passed
+ *  through the wrapper, starting from the size of the wrapped inputter/outputter.
+ */
+class ZlingPipelinedInputter: public Inputter {
+public:
+    ZlingPipelinedInputter(Inputter* inputter, size_t chunk_size, int chunk_num);
+    ~ZlingPipelinedInputter();
+
+    size_t GetData(unsigned char* buf, size_t len);
+    bool   IsEnd();
+    bool   IsErr();
+    size_t GetInputSize();
+
+private:
+    struct Chunk {
+        std::vector<unsigned char> buf;
+        size_t len;
+        bool filled;
+    };
+    bool NextChunk();
+    void IOLoop();
+
+    Inputter* m_inputter;
+    std::vector<Chunk> m_chunks;
+    size_t m_total_read;  /* by the codec thread */
+    size_t m_ridx;
+    size_t m_rpos;
+    bool m_rheld;
+    bool m_done;
+    bool m_stop;
+    std::atomic<bool> m_err;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::thread m_thread;
+
+    ZlingPipelinedInputter(const ZlingPipelinedInputter&);
+    ZlingPipelinedInputter& operator = (const ZlingPipelinedInputter&);
+};
+
+class ZlingPipelinedOutputter: public Outputter {
+public:
+    ZlingPipelinedOutputter(Outputter* outputter, size_t chunk_size, int chunk_num);
+    ~ZlingPipelinedOutputter();
+
+    size_t PutData(unsigned char* buf, size_t len);
+    bool   IsErr();
+    size_t GetOutputSize();
+    void   Flush();
+
+private:
+    struct Chunk {
+        std::vector<unsigned char> buf;
+        size_t len;
+        bool filled;
+    };
+    void NextChunk();
+    void IOLoop();
+
+    Outputter* m_outputter;
+    std::vector<Chunk> m_chunks;
+    size_t m_total_write;  /* by the codec thread */
+    size_t m_widx;
+    size_t m_nfilled;
+    bool m_stop;
+    std::atomic<bool> m_err;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::thread m_thread;
+
+    ZlingPipelinedOutputter(const ZlingPipelinedOutputter&);
+    ZlingPipelinedOutputter& operator = (const ZlingPipelinedOutputter&);
+};
+
+}  // namespace thread
+}  // namespace zling
+}  // namespace baidu
+#endif  // SRC_LIBZLING_THREAD_H
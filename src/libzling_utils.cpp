@@ -34,6 +34,10 @@
  */
 #include "libzling_utils.h"
 
+#if defined(__linux__)
+#include <sys/mman.h>  // madvise()
+#endif
+
 namespace baidu {
 namespace zling {
 
@@ -91,5 +95,116 @@ size_t FileOutputter::GetOutputSize() {
     return m_total_write;
 }
 
+size_t MemoryInputter::GetData(unsigned char* buf, size_t len) {
+    size_t idatasize = std::min(len, m_len - m_total_read);
+    memcpy(buf, m_buf + m_total_read, idatasize);
+    m_total_read += idatasize;
+    return idatasize;
+}
+bool MemoryInputter::IsEnd() {
+    return m_total_read == m_len;
+}
+bool MemoryInputter::IsErr() {
+    return false;
+}
+size_t MemoryInputter::GetInputSize() {
+    return m_total_read;
+}
+
+size_t MemoryOutputter::PutData(unsigned char* buf, size_t len) {
+    m_buf->insert(m_buf->end(), buf, buf + len);
+    return len;
+}
+bool MemoryOutputter::IsErr() {
+    return false;
+}
+size_t MemoryOutputter::GetOutputSize() {
+    return m_buf->size();
+}
+
+static const size_t kAllocatorAlignment = 64;
+static const size_t kHugePageSize = 2097152;
+
+struct DefaultAllocator: public Allocator {
+    void* Allocate(size_t size) {
+        return ::operator new(size);
+    }
+    void Free(void* ptr, size_t /*size*/) {
+        ::operator delete(ptr);
+    }
+};
+
+struct HugePageAllocator: public Allocator {
+    void* Allocate(size_t size) {
+#if defined(__linux__)
+        void* ptr;
+
+        size = (size + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+        if (posix_memalign(&ptr, kHugePageSize, size) != 0) {
+            throw std::bad_alloc();
+        }
+        madvise(ptr, size, MADV_HUGEPAGE);  /* advisory, ignore failure */
+        return ptr;
+#else
+        return ::operator new(size);
+#endif
+    }
+    void Free(void* ptr, size_t /*size*/) {
+#if defined(__linux__)
+        free(ptr);
+#else
+        ::operator delete(ptr);
+#endif
+    }
+};
+
+Allocator* GetDefaultAllocator() {
+    static DefaultAllocator allocator;
+    return &allocator;
+}
+
+Allocator* GetHugePageAllocator() {
+    static HugePageAllocator allocator;
+    return &allocator;
+}
+
+ArenaAllocator::ArenaAllocator(size_t capacity, Allocator* base):
+    m_base(base),
+    m_buf(static_cast<unsigned char*>(base->Allocate(capacity))),
+    m_capacity(capacity),
+    m_used(0) {
+    return;
+}
+
+ArenaAllocator::~ArenaAllocator() {
+    m_base->Free(m_buf, m_capacity);
+}
+
+void* ArenaAllocator::Allocate(size_t size) {
+    size_t offset = (reinterpret_cast<uintptr_t>(m_buf) + m_used + kAllocatorAlignment - 1)
+        / kAllocatorAlignment * kAllocatorAlignment - reinterpret_cast<uintptr_t>(m_buf);
+
+    if (offset > m_capacity || size > m_capacity - offset) {
+        throw std::bad_alloc();
+    }
+    m_used = offset + size;
+    return m_buf + offset;
+}
+
+void ArenaAllocator::Free(void* /*ptr*/, size_t /*size*/) {
+    return;
+}
+
+uint32_t ComputeAdler32(const unsigned char* data, size_t size) {
+    uint32_t a = 1;
+    uint32_t b = 0;
+
+    for (size_t i = 0; i < size; i++) {
+        a = (a + data[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    return (b << 16) | a;
+}
+
 }  // namespace zling
 }  // namespace baidu
@@ -44,11 +44,16 @@ namespace zling {
  *  Inputter:       interface for an abstract inputter.
  *  Outputter:      interface for an abstract outputter.
  *  ActionHandler: interface for an abstract action handler (normally used for printing process.)
+ *
+ *  GetInputSize()/GetOutputSize(): bytes read/written so far, 0 if not counted by the implementation.
  */
 struct Inputter {
     virtual size_t GetData(unsigned char* buf, size_t len) = 0;
     virtual bool IsEnd() = 0;
     virtual bool IsErr() = 0;
+    virtual size_t GetInputSize() {
+        return 0;
+    }
 
     int GetChar();
     uint32_t GetUInt32();
@@ -56,6 +61,9 @@ struct Inputter {
 struct Outputter {
     virtual size_t PutData(unsigned char* buf, size_t len) = 0;
     virtual bool IsErr() = 0;
+    virtual size_t GetOutputSize() {
+        return 0;
+    }
 
     int PutChar(int v);
     uint32_t PutUInt32(uint32_t v);
@@ -118,6 +126,79 @@ private:
     size_t m_total_write;
 };
 
+/* MemoryInputter/MemoryOutputter:
+ *  in-memory implementation of Inputter/Outputter, MemoryOutputter appends data to a std::vector.
+ */
+struct MemoryInputter: public baidu::zling::Inputter {
+    MemoryInputter(const unsigned char* buf, size_t len):
+        m_buf(buf),
+        m_len(len),
+        m_total_read(0) {}
+
+    size_t GetData(unsigned char* buf, size_t len);
+    bool   IsEnd();
+    bool   IsErr();
+    size_t GetInputSize();
+
+private:
+    const unsigned char* m_buf;
+    size_t m_len;
+    size_t m_total_read;
+};
+
+struct MemoryOutputter: public baidu::zling::Outputter {
+    MemoryOutputter(std::vector<unsigned char>* buf):
+        m_buf(buf) {}
+
+    size_t PutData(unsigned char* buf, size_t len);
+    bool   IsErr();
+    size_t GetOutputSize();
+
+private:
+    std::vector<unsigned char>* m_buf;
+};
+
+/* Allocator: interface for allocating large codec buffers (block buffers and ROLZ buckets).
+ *  Allocate(): returns memory aligned for any fundamental type, throws std::bad_alloc on failure.
+ *  Free():     size is the same as passed to Allocate().
+ *
+ *  GetDefaultAllocator():  operator new/delete.
+ *  GetHugePageAllocator(): 2MB aligned memory advised for transparent huge pages (MADV_HUGEPAGE)
+ *                          on linux, reducing TLB misses of random bucket access. same as the
+ *                          default allocator on other platforms.
+ */
+struct Allocator {
+    virtual ~Allocator() {}
+    virtual void* Allocate(size_t size) = 0;
+    virtual void  Free(void* ptr, size_t size) = 0;
+};
+
+Allocator* GetDefaultAllocator();
+Allocator* GetHugePageAllocator();
+
+/* ArenaAllocator: carves cache line aligned allocations out of one contiguous buffer from a base
+ *  allocator. Free() is a no-op, the buffer is returned to the base allocator on destruction.
+ */
+struct ArenaAllocator: public baidu::zling::Allocator {
+    ArenaAllocator(size_t capacity, Allocator* base = GetDefaultAllocator());
+    ~ArenaAllocator();
+
+    void* Allocate(size_t size);
+    void  Free(void* ptr, size_t size);
+
+private:
+    Allocator* m_base;
+    unsigned char* m_buf;
+    size_t m_capacity;
+    size_t m_used;
+
+    ArenaAllocator(const ArenaAllocator&);
+    ArenaAllocator& operator = (const ArenaAllocator&);
+};
+
+/* ComputeAdler32: adler32 checksum of data (1 for empty data). */
+uint32_t ComputeAdler32(const unsigned char* data, size_t size);
+
 }  // namespace zling
 }  // namespace baidu
 #endif  // SRC_LIBZLING_UTILS_H
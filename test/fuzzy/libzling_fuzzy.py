@@ -7,6 +7,9 @@ import subprocess
 import random
 import hashlib
 import argparse
+import tempfile
+
+LEVEL_AUTO = 1000
 
 def _dump(testdata, **kwargs):
     dump_path = os.path.join(sys.path[0], "fuzzdump_" + hashlib.md5(testdata).hexdigest())
@@ -17,49 +20,172 @@ def _dump(testdata, **kwargs):
             f.write(kwargs_data)
     return None
 
-def _run_fuzzy_round(zling_demo_bin, fuzzy_size):
+def _random_bytes(size):
+    return bytes(bytearray(random.randrange(256) for _ in range(size)))
+
+def _random_text(size):
+    ## lines of words (few contexts, skewed word frequencies), ROLZ finds matches of any length and distance
+    letters = bytearray(random.sample(range(33, 127), random.randint(1, 32)))
+    vocabulary = [bytes(bytearray(random.choice(letters) for _ in range(random.randint(1, 12))))
+                  for _ in range(random.randint(1, 4096))]
+    text = bytearray()
+    while len(text) < size:
+        text += vocabulary[int(len(vocabulary) * random.random() ** 3)]
+        text += random.choice([b" ", b" ", b" ", b", ", b"\n", b"\n    "])
+    return bytes(text[:size])
+
+def _random_copies(size):
+    ## mutated copies of a piece, blocks (and batch items) see the same data at the same positions
+    piece = bytearray(_random_text(random.randint(1, max(size // 4, 1))))
+    data = bytearray()
+    while len(data) < size:
+        for _ in range(random.randint(0, 8)):
+            piece[random.randrange(len(piece))] = random.randrange(256)
+        data += piece
+    return bytes(data[:size])
+
+def _random_reused_blocks(block_size, blocks):
+    ## blocks in pairs of the same layout: a piece with 3 positions of context c, its repeat, and a match
+    ## of the repeat's second position of context c. the repeat is mutated (so encoded as literals) in the
+    ## first block and matched in the second, where level 5 parses nodes skipped by that match, which
+    ## hold the same positions since the first block.
+    data = bytearray()
+    for block in range(blocks):
+        if block % 2 == 0:
+            pair_seed = random.randrange(1 << 30)
+        layout = random.Random(pair_seed)
+        filler = lambda n: bytes(bytearray(layout.randrange(64) for _ in range(n)))
+        mutated = lambda n: bytes(bytearray(random.randrange(64) for _ in range(n)))
+
+        block_data = bytearray()
+        while len(block_data) < block_size:
+            c = bytes(bytearray([128 + len(block_data) % 128]))
+            f = [filler(3) for _ in range(4)]
+            u = [filler(8), filler(5), filler(3), filler(6)]
+            piece = b"y" + f[0] + c + f[1] + c + f[2] + c + f[3]
+            repeat = piece if block % 2 == 1 else b"y" + mutated(3) + c + mutated(3) + c + mutated(3) + c + mutated(3)
+            block_data += u[0] + piece + u[1] + repeat + u[2] + c + f[2] + c + f[3] + u[2] + u[3]
+        data += block_data[:block_size]
+    return bytes(data)
+
+def _random_input(fuzzy_size):
     fuzzy_size = random.randint(0, fuzzy_size)
-    fuzzy_input = str().join(map(lambda _: chr(random.randrange(256)), xrange(fuzzy_size)))
-
-    for level in range(0, 4):
-        pipe = subprocess.Popen(
-                [zling_demo_bin, "e%s" % level], stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
-        enc_outdata, enc_errdata = pipe.communicate(fuzzy_input)
-
-        pipe = subprocess.Popen(
-                [zling_demo_bin, "d"], stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
-        dec_outdata, dec_errdata = pipe.communicate(enc_outdata)
-
-        if dec_outdata != fuzzy_input:
-            _dump(fuzzy_input, **{
-                "fuzzy_input": fuzzy_input,
-                "enc_out": enc_outdata,
-                "enc_err": enc_errdata,
-                "dec_out": dec_outdata,
-                "dec_err": dec_errdata,
-            })
+    return random.choice([_random_bytes, _random_text, _random_copies])(fuzzy_size)
+
+def _random_dictionary(fuzzy_input):
+    ## dictionary data is data expected in the streams, at most half of the smallest block size (64KB)
+    if len(fuzzy_input) > 0 and random.randint(0, 1) == 0:
+        dict_start = random.randrange(len(fuzzy_input))
+        return fuzzy_input[dict_start:dict_start + random.randint(1, 32768)]
+    return _random_text(random.randint(1, 32768))
+
+def _run(args, indata):
+    pipe = subprocess.Popen(args, stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    outdata, errdata = pipe.communicate(indata)
+    return pipe.returncode, outdata, errdata
+
+def _random_options(dict_path):
+    enc_options = []
+    dec_options = []
+    if random.randint(0, 1) == 0:
+        enc_options += ["-b", str(random.choice([64, 128, 256, 1024]))]
+    if random.randint(0, 1) == 0:
+        enc_options += ["-t", str(random.randint(2, 4))]
+    if random.randint(0, 1) == 0:
+        dec_options += ["-t", str(random.randint(2, 4))]
+    if random.randint(0, 1) == 0:
+        enc_options += ["-p"]
+        dec_options += ["-p"]
+    if random.randint(0, 1) == 0:
+        enc_options += ["-D", dict_path]
+        dec_options += ["-D", dict_path]
+    return enc_options, dec_options
+
+def _run_demo_case(zling_demo_bin, fuzzy_input, level, enc_options, dec_options):
+    enc_ret, enc_outdata, enc_errdata = _run([zling_demo_bin] + enc_options + [level], fuzzy_input)
+    dec_ret, dec_outdata, dec_errdata = _run([zling_demo_bin] + dec_options + ["d"], enc_outdata)
+
+    if enc_ret != 0 or dec_ret != 0 or dec_outdata != fuzzy_input:
+        _dump(fuzzy_input, **{
+            "fuzzy_input": fuzzy_input,
+            "enc_args": " ".join(enc_options + [level]).encode(),
+            "enc_out": enc_outdata,
+            "enc_err": enc_errdata,
+            "dec_args": " ".join(dec_options + ["d"]).encode(),
+            "dec_out": dec_outdata,
+            "dec_err": dec_errdata,
+        })
+        return False
+    return True
+
+def _run_api_case(zling_api_bin, fuzzy_input, level, items, block_size, dict_path):
+    api_args = [str(level), str(items), str(block_size)] + ([dict_path] if dict_path else [])
+    api_ret, api_outdata, api_errdata = _run([zling_api_bin] + api_args, fuzzy_input)
+
+    if api_ret != 0:
+        _dump(fuzzy_input, **{
+            "fuzzy_input": fuzzy_input,
+            "api_args": " ".join(api_args).encode(),
+            "api_err": api_errdata,
+        })
+        return False
+    return True
+
+def _run_fuzzy_round(zling_demo_bin, zling_api_bin, fuzzy_size, dict_path):
+    fuzzy_input = _random_input(fuzzy_size)
+    with open(dict_path, "wb") as f:
+        f.write(_random_dictionary(fuzzy_input))
+
+    ## every level with random options
+    levels = ["e-1", "e0", "e1", "e2", "e3", "e4", "e5", "ea", "ea0", "ea%s" % random.randint(1, 100)]
+    for level in levels:
+        enc_options, dec_options = _random_options(dict_path)
+        if not _run_demo_case(zling_demo_bin, fuzzy_input, level, enc_options, dec_options):
+            return False
+
+    ## batch and context APIs, items are coded one after another by the same encoder/decoder state
+    if zling_api_bin:
+        level = random.choice(list(range(-1, 6)) + [LEVEL_AUTO + random.randint(0, 100)])
+        items = random.randint(1, 8)
+        block_size = random.choice([64, 128, 256, 16384])
+        if not _run_api_case(zling_api_bin, fuzzy_input, level, items, block_size, random.choice([None, dict_path])):
             return False
+
+    ## level 5 with small blocks and reused encoder state
+    blocks = random.randint(2, 8)
+    reused_input = _random_reused_blocks(65536, blocks)
+    if not _run_demo_case(zling_demo_bin, reused_input, "e5", ["-b", "64"], []):
+        return False
+    if zling_api_bin and not _run_api_case(zling_api_bin, reused_input, 5, blocks, 128, None):
+        return False
     return True
 
 if __name__ == "__main__":
     ## init arguments
     argparser = argparse.ArgumentParser()
     argparser.add_argument("--zling_demo_bin", type=str)
+    argparser.add_argument("--zling_api_bin", type=str, default=None)
     argparser.add_argument("--fuzzy_size", type=int)
     argparser.add_argument("--fuzzy_round", type=int)
     args = argparser.parse_args()
     zling_demo_bin = args.zling_demo_bin
+    zling_api_bin  = args.zling_api_bin
     fuzzy_size     = args.fuzzy_size
     fuzzy_round    = args.fuzzy_round
 
+    dict_fd, dict_path = tempfile.mkstemp(prefix="libzling_fuzzy_dict_")
+    os.close(dict_fd)
+
     fuzzy_succ = True
     for n in range(fuzzy_round):
-        if _run_fuzzy_round(zling_demo_bin, fuzzy_size):
+        if _run_fuzzy_round(zling_demo_bin, zling_api_bin, fuzzy_size, dict_path):
             sys.stderr.write(".")
         else:
             fuzzy_succ = False
             sys.stderr.write("X")
+        sys.stderr.flush()
     sys.stderr.write("\n")
+    os.remove(dict_path)
 
     if fuzzy_succ:
         sys.stderr.write("libzling_fuzzy test passed!\n")
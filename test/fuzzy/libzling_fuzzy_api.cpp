@@ -0,0 +1,162 @@
+/**
+ * zling:
+ *  light-weight lossless data compression utility.
+ *
+ * Copyright (C) 2012-2013 by Zhang Li <zhangli10 at baidu.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @author zhangli10<zhangli10@baidu.com>
+ * @brief  libzling fuzzy test driver of the batch and context APIs.
+ */
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "libzling/libzling.h"
+
+typedef std::vector<std::vector<unsigned char> > Buffers;
+
+static void ReadAll(FILE* fp, std::vector<unsigned char>* data) {
+    unsigned char buf[4096];
+    size_t len;
+
+    while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        data->insert(data->end(), buf, buf + len);
+    }
+}
+
+static bool CheckEqual(const Buffers& a, const Buffers& b, const char* message) {
+    if (a != b) {
+        fprintf(stderr, "libzling_fuzzy_api: %s\n", message);
+        return false;
+    }
+    return true;
+}
+
+/* encode and decode stdin (split into items) with ZlingBatchCodec and with reused contexts,
+ *  items are coded one after another by the same encoder/decoder state in both APIs.
+ */
+static int RunFuzzyApi(int level, int items, const baidu::zling::ZlingConfig& config,
+                       const baidu::zling::ZlingDictionary* dictionary) {
+    std::vector<unsigned char> input;
+    Buffers ibufs(items);
+
+    ReadAll(stdin, &input);
+    for (int i = 0; i < items; i++) {
+        ibufs[i].assign(input.begin() + input.size() * i / items, input.begin() + input.size() * (i + 1) / items);
+    }
+
+    // batch: a second call reuses the worker resources of the first one
+    baidu::zling::ZlingBatchCodec codec(2, config, baidu::zling::GetDefaultAllocator(), dictionary);
+    Buffers encoded;
+    Buffers encoded_again;
+    Buffers decoded;
+
+    if (codec.Encode(ibufs, &encoded, level) != 0 || codec.Encode(ibufs, &encoded_again, level) != 0) {
+        fprintf(stderr, "libzling_fuzzy_api: batch encode failed.\n");
+        return -1;
+    }
+    if (codec.Decode(encoded, &decoded) != 0) {
+        fprintf(stderr, "libzling_fuzzy_api: batch decode failed.\n");
+        return -1;
+    }
+    if (!CheckEqual(encoded, encoded_again, "batch output differs between calls.")
+            || !CheckEqual(decoded, ibufs, "batch decoded data not match.")) {
+        return -1;
+    }
+
+    // context: the same streams as the batch codec
+    baidu::zling::ZlingEncoderContext encoder(config);
+    baidu::zling::ZlingDecoderContext decoder(config);
+    Buffers context_encoded(items);
+    Buffers context_decoded(items);
+
+    for (int i = 0; i < items; i++) {
+        baidu::zling::MemoryInputter inputter(ibufs[i].data(), ibufs[i].size());
+        baidu::zling::MemoryOutputter outputter(&context_encoded[i]);
+
+        if (baidu::zling::Encode(&encoder, &inputter, &outputter, NULL, level, false, dictionary) != 0) {
+            fprintf(stderr, "libzling_fuzzy_api: context encode failed.\n");
+            return -1;
+        }
+    }
+    for (int i = 0; i < items; i++) {
+        baidu::zling::MemoryInputter inputter(context_encoded[i].data(), context_encoded[i].size());
+        baidu::zling::MemoryOutputter outputter(&context_decoded[i]);
+
+        if (baidu::zling::Decode(&decoder, &inputter, &outputter, NULL, false, dictionary) != 0) {
+            fprintf(stderr, "libzling_fuzzy_api: context decode failed.\n");
+            return -1;
+        }
+    }
+    if (!CheckEqual(context_encoded, encoded, "context output differs from batch output.")
+            || !CheckEqual(context_decoded, ibufs, "context decoded data not match.")) {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 4 || argc > 5) {
+        fprintf(stderr, "usage:\n");
+        fprintf(stderr, "   libzling_fuzzy_api level items block_size [dictionary] < input\n");
+        fprintf(stderr, "    * level:      level of Encode() (kLevelAuto + weight for automatic levels).\n");
+        fprintf(stderr, "    * items:      number of equal parts input is split into.\n");
+        fprintf(stderr, "    * block_size: block size in KB.\n");
+        fprintf(stderr, "    * dictionary: preset dictionary file.\n");
+        return -1;
+    }
+    baidu::zling::ZlingConfig config;
+    std::vector<unsigned char> dict_data;
+
+    config.block_size = atoi(argv[3]) * 1024;
+    if (argc == 5) {
+        FILE* fp = fopen(argv[4], "rb");
+
+        if (fp == NULL) {
+            fprintf(stderr, "error: cannot open file '%s' for read.\n", argv[4]);
+            return -1;
+        }
+        ReadAll(fp, &dict_data);
+        fclose(fp);
+    }
+
+    try {
+        std::unique_ptr<baidu::zling::ZlingDictionary> dictionary(
+            dict_data.empty() ? NULL : new baidu::zling::ZlingDictionary(dict_data.data(), dict_data.size()));
+
+        return RunFuzzyApi(atoi(argv[1]), std::max(atoi(argv[2]), 1), config, dictionary.get());
+
+    } catch (const std::runtime_error& e) {
+        fprintf(stderr, "libzling_fuzzy_api: runtime error: %s\n", e.what());
+        return -1;
+    }
+}